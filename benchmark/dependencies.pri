@@ -0,0 +1 @@
+DEPENDENCIES += tp_task_queue
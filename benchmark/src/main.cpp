@@ -0,0 +1,322 @@
+#include "tp_task_queue/TaskQueue.h"
+#include "tp_task_queue/WorkQueue.h"
+#include "tp_task_queue/SynchronizationPoint.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+//##################################################################################################
+//! Micro benchmarks for tp_task_queue.
+/*!
+Each result is printed as a single line of JSON so that runs can be collected and compared, for
+example: ./tp_task_queue_benchmark > bench_output.txt
+
+Options:
+  --quick       Run fewer iterations, for checking that the benchmarks work.
+  --filter NAME Only run benchmarks whose name contains NAME.
+*/
+
+using namespace tp_task_queue;
+
+namespace
+{
+using Clock_lt = std::chrono::steady_clock;
+
+//##################################################################################################
+struct Options_lt
+{
+  size_t scale{10};
+  std::string filter;
+};
+
+Options_lt options_lt;
+
+//##################################################################################################
+double secondsSince_lt(Clock_lt::time_point start)
+{
+  return std::chrono::duration<double>(Clock_lt::now() - start).count();
+}
+
+//##################################################################################################
+int64_t nanosecondsSince_lt(Clock_lt::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock_lt::now() - start).count();
+}
+
+//##################################################################################################
+bool enabled_lt(const char* name)
+{
+  return options_lt.filter.empty() || std::strstr(name, options_lt.filter.c_str());
+}
+
+//##################################################################################################
+//! Print a result as a line of JSON.
+void report_lt(const char* benchmark,
+               const char* parameter,
+               size_t parameterValue,
+               const char* metric,
+               double value,
+               const char* unit)
+{
+  std::printf("{\"benchmark\":\"%s\",\"%s\":%zu,"
+              "\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n",
+              benchmark, parameter, parameterValue, metric, value, unit);
+  std::fflush(stdout);
+}
+
+//##################################################################################################
+std::vector<size_t> threadCounts_lt()
+{
+  size_t hardware = tpMax(size_t(1), size_t(std::thread::hardware_concurrency()));
+  std::vector<size_t> counts;
+  for(size_t n=1; n<hardware*2; n*=2)
+    counts.push_back(n);
+  counts.push_back(hardware*2);
+  return counts;
+}
+
+//##################################################################################################
+//! Wait without blocking in the library so that completion is measured, not a wake up.
+void waitFor_lt(const std::atomic<size_t>& counter, size_t value)
+{
+  while(counter.load(std::memory_order_acquire)<value)
+    std::this_thread::yield();
+}
+
+//##################################################################################################
+double percentile_lt(std::vector<int64_t>& samples, double p)
+{
+  if(samples.empty())
+    return 0.0;
+  std::sort(samples.begin(), samples.end());
+  size_t i = std::min(samples.size()-1, size_t(p*double(samples.size())));
+  return double(samples[i]);
+}
+
+//##################################################################################################
+//! Time from addTask or post to the task starting on an idle queue.
+void submitLatency_lt()
+{
+  if(!enabled_lt("submit_latency"))
+    return;
+
+  TaskQueue taskQueue("bench", 1);
+  size_t iterations = 200*options_lt.scale;
+
+  for(int mode=0; mode<2; mode++)
+  {
+    std::vector<int64_t> samples;
+    samples.reserve(iterations);
+    for(size_t i=0; i<iterations; i++)
+    {
+      std::atomic<size_t> started{0};
+      int64_t latency=0;
+      auto start = Clock_lt::now();
+      auto record = [&]
+      {
+        latency = nanosecondsSince_lt(start);
+        started.store(1, std::memory_order_release);
+      };
+
+      if(mode==0)
+        taskQueue.addTask(new Task("latency", [&](Task&){record(); return RunAgain::No;}));
+      else
+        taskQueue.post(record);
+
+      waitFor_lt(started, 1);
+      samples.push_back(latency);
+
+      // Let the worker go idle again so that each sample includes the wake up.
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    const char* name = (mode==0)?"submit_latency_add_task":"submit_latency_post";
+    report_lt(name, "threads", 1, "p50", percentile_lt(samples, 0.50)/1000.0, "us");
+    report_lt(name, "threads", 1, "p99", percentile_lt(samples, 0.99)/1000.0, "us");
+  }
+}
+
+//##################################################################################################
+//! Empty tasks per second from one producer against the number of worker threads.
+void emptyTaskThroughput_lt()
+{
+  if(!enabled_lt("empty_task_throughput"))
+    return;
+
+  size_t tasks = 10000*options_lt.scale;
+  for(size_t threads : threadCounts_lt())
+  {
+    for(int mode=0; mode<2; mode++)
+    {
+      TaskQueue taskQueue("bench", threads);
+      std::atomic<size_t> done{0};
+
+      auto start = Clock_lt::now();
+      for(size_t i=0; i<tasks; i++)
+      {
+        if(mode==0)
+          taskQueue.addTask(new Task("empty", [&](Task&)
+          {
+            done.fetch_add(1, std::memory_order_release);
+            return RunAgain::No;
+          }));
+        else
+          taskQueue.post([&]{done.fetch_add(1, std::memory_order_release);});
+      }
+      waitFor_lt(done, tasks);
+      double seconds = secondsSince_lt(start);
+
+      const char* name = (mode==0)?"empty_task_throughput_add_task":"empty_task_throughput_post";
+      report_lt(name, "threads", threads, "throughput", double(tasks)/seconds, "tasks/s");
+    }
+  }
+}
+
+//##################################################################################################
+//! Closures per second through a WorkQueue fed by several producer threads.
+void workQueueThroughput_lt()
+{
+  if(!enabled_lt("work_queue_throughput"))
+    return;
+
+  size_t itemsPerProducer = 5000*options_lt.scale;
+  TaskQueue taskQueue("bench", 2);
+  for(size_t producers : threadCounts_lt())
+  {
+    for(int mode=0; mode<2; mode++)
+    {
+      size_t count=0;
+      auto start = Clock_lt::now();
+      {
+        std::unique_ptr<WorkQueue> workQueue;
+        if(mode==0)
+          workQueue = std::make_unique<WorkQueue>("bench");
+        else
+        {
+          workQueue = std::make_unique<WorkQueue>("bench", &taskQueue);
+          workQueue->setBatchSize(256);
+        }
+
+        std::vector<std::thread> threads;
+        for(size_t p=0; p<producers; p++)
+          threads.emplace_back([&]
+          {
+            for(size_t i=0; i<itemsPerProducer; i++)
+              workQueue->addTask([&]{count++;});
+          });
+
+        for(auto& thread : threads)
+          thread.join();
+      }
+      double seconds = secondsSince_lt(start);
+
+      const char* name = (mode==0)?"work_queue_throughput_thread":
+                                    "work_queue_throughput_task_queue";
+      report_lt(name, "producers", producers, "throughput", double(count)/seconds, "items/s");
+    }
+  }
+}
+
+//##################################################################################################
+//! The cost of adding a fan out of tasks to a SynchronizationPoint and joining it.
+void synchronizationPointFanOut_lt()
+{
+  if(!enabled_lt("sync_point_fan_out"))
+    return;
+
+  size_t hardware = tpMax(size_t(1), size_t(std::thread::hardware_concurrency()));
+  TaskQueue taskQueue("bench", hardware);
+  for(size_t fanOut : {size_t(10), size_t(100), size_t(1000)})
+  {
+    size_t rounds = tpMax(size_t(1), 2000*options_lt.scale/fanOut);
+    auto start = Clock_lt::now();
+    for(size_t r=0; r<rounds; r++)
+    {
+      SynchronizationPoint synchronizationPoint;
+      for(size_t i=0; i<fanOut; i++)
+      {
+        auto task = new Task("fan out", [](Task&){return RunAgain::No;});
+        synchronizationPoint.addTask(task);
+        taskQueue.addTask(task);
+      }
+      synchronizationPoint.join();
+    }
+    double seconds = secondsSince_lt(start);
+    double roundTime = seconds*1e6/double(rounds);
+    report_lt("sync_point_fan_out", "fan_out", fanOut, "round_time", roundTime, "us");
+  }
+}
+
+//##################################################################################################
+//! The cost of Task::updateTaskStatus with status changed callbacks registered on the queue.
+void statusUpdateOverhead_lt()
+{
+  if(!enabled_lt("status_update"))
+    return;
+
+  size_t updates = 10000*options_lt.scale;
+  for(size_t callbacks : {size_t(0), size_t(1), size_t(10), size_t(100)})
+  {
+    TaskQueue taskQueue("bench", 1);
+    std::atomic<size_t> calls{0};
+    std::vector<std::function<void()>> functions(callbacks, [&]
+    {
+      calls.fetch_add(1, std::memory_order_relaxed);
+    });
+    for(const auto& function : functions)
+      taskQueue.addStatusChangedCallback(&function);
+
+    int64_t nanoseconds=0;
+    {
+      SynchronizationPoint synchronizationPoint;
+      auto task = new Task("status", [&](Task& runningTask)
+      {
+        auto start = Clock_lt::now();
+        for(size_t i=0; i<updates; i++)
+          runningTask.updateTaskStatus("Working", int(i%100));
+        nanoseconds = nanosecondsSince_lt(start);
+        return RunAgain::No;
+      });
+      synchronizationPoint.addTask(task);
+      taskQueue.addTask(task);
+    }
+
+    for(const auto& function : functions)
+      taskQueue.removeStatusChangedCallback(&function);
+
+    double updateTime = double(nanoseconds)/double(updates);
+    report_lt("status_update", "callbacks", callbacks, "update_time", updateTime, "ns");
+  }
+}
+}
+
+//##################################################################################################
+int main(int argc, char* argv[])
+{
+  for(int i=1; i<argc; i++)
+  {
+    if(std::strcmp(argv[i], "--quick")==0)
+      options_lt.scale = 1;
+    else if(std::strcmp(argv[i], "--filter")==0 && (i+1)<argc)
+      options_lt.filter = argv[++i];
+    else
+    {
+      std::fprintf(stderr, "Usage: %s [--quick] [--filter NAME]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  submitLatency_lt();
+  emptyTaskThroughput_lt();
+  workQueueThroughput_lt();
+  synchronizationPointFanOut_lt();
+  statusUpdateOverhead_lt();
+  return 0;
+}
@@ -0,0 +1,4 @@
+TARGET = tp_task_queue_benchmark
+TEMPLATE = app
+
+SOURCES += src/main.cpp
@@ -0,0 +1,229 @@
+#ifndef tp_task_queue_Coroutine_h
+#define tp_task_queue_Coroutine_h
+
+#include "tp_task_queue/TaskQueue.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#define TP_TASK_QUEUE_COROUTINES
+
+namespace tp_task_queue
+{
+
+//##################################################################################################
+//! Resumes a suspended coroutine task through its queue, shared with the awaits that wait on it.
+/*!
+Once the task has been deleted resume does nothing, detach waits for any resume that is in
+progress so that the queue is not touched after the task has gone.
+*/
+class TP_TASK_QUEUE_EXPORT CoroutineResumer
+{
+  TP_NONCOPYABLE(CoroutineResumer);
+public:
+  //################################################################################################
+  CoroutineResumer(TaskQueue* taskQueue, int64_t taskID);
+
+  //################################################################################################
+  void resume(int64_t delayMS);
+
+  //################################################################################################
+  void detach();
+
+private:
+  TPMutex mutex{TPM};
+  TPWaitCondition waitCondition;
+  TaskQueue* taskQueue;
+  int64_t taskID;
+  size_t inFlight{0};
+};
+
+//##################################################################################################
+//! The return type of a coroutine that runs as a task, see makeCoroutineTask.
+/*!
+Inside the coroutine these suspend the task without holding a worker:
+ - co_await yield(); goes to the back of the ready queue.
+ - co_await sleepFor(ms); runs again after ms.
+ - co_await future; for a Future from TaskQueue::submit, Task::finished or a Promise, this
+   returns the result or rethrows its exception.
+
+Each time the task is resumed it goes through the ready queue of its TaskQueue so priorities,
+pausing and cancellation work as they do for other tasks. If the task is cancelled the coroutine is
+destroyed at its next resume instead of being continued.
+
+An exception that escapes the coroutine finishes the task and is handed to Task::setException, so
+co_await task->finished() in another coroutine rethrows it. If nothing is waiting it is logged.
+*/
+class TP_TASK_QUEUE_EXPORT TaskCoroutine
+{
+public:
+  //################################################################################################
+  //! Suspends the task and asks for it to be resumed after delayMS.
+  struct DelayAwaiter
+  {
+    int64_t delayMS;
+
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    template<typename Promise>
+    void await_suspend(std::coroutine_handle<Promise> handle) const noexcept
+    {
+      handle.promise().resumeDelayMS = delayMS;
+    }
+
+    void await_resume() const noexcept
+    {
+
+    }
+  };
+
+  //################################################################################################
+  //! Suspends the task until a future is ready.
+  template<typename T>
+  struct FutureAwaiter
+  {
+    Future<T> future;
+
+    bool await_ready() const
+    {
+      return future.isReady();
+    }
+
+    template<typename Promise>
+    void await_suspend(std::coroutine_handle<Promise> handle)
+    {
+      future.whenReady([resumer = handle.promise().resumer]
+      {
+        resumer->resume(0);
+      });
+    }
+
+    T await_resume()
+    {
+      return future.get();
+    }
+  };
+
+  //################################################################################################
+  struct promise_type
+  {
+    std::shared_ptr<CoroutineResumer> resumer;
+    std::exception_ptr exception;
+
+    //! Set by DelayAwaiter, -1 when the coroutine will be resumed by something else.
+    int64_t resumeDelayMS{-1};
+
+    TaskCoroutine get_return_object()
+    {
+      return TaskCoroutine(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept
+    {
+      return {};
+    }
+
+    std::suspend_always final_suspend() noexcept
+    {
+      return {};
+    }
+
+    void return_void()
+    {
+
+    }
+
+    void unhandled_exception()
+    {
+      exception = std::current_exception();
+    }
+
+    DelayAwaiter await_transform(DelayAwaiter awaiter)
+    {
+      return awaiter;
+    }
+
+    template<typename T>
+    FutureAwaiter<T> await_transform(Future<T> future)
+    {
+      return FutureAwaiter<T>{std::move(future)};
+    }
+  };
+
+  //################################################################################################
+  TaskCoroutine(TaskCoroutine&& other) noexcept;
+
+  //################################################################################################
+  TaskCoroutine& operator=(TaskCoroutine&& other) noexcept;
+
+  //################################################################################################
+  ~TaskCoroutine();
+
+  //################################################################################################
+  //! Run the coroutine until it next suspends, this is called by the task.
+  RunAgain resume(Task& task);
+
+private:
+  //################################################################################################
+  TaskCoroutine(std::coroutine_handle<promise_type> handle);
+
+  //################################################################################################
+  void destroy();
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+//##################################################################################################
+//! Let other tasks run and then carry on, for use with co_await in a TaskCoroutine.
+inline TaskCoroutine::DelayAwaiter yield()
+{
+  return {0};
+}
+
+//##################################################################################################
+//! Suspend the task for a time, for use with co_await in a TaskCoroutine.
+inline TaskCoroutine::DelayAwaiter sleepFor(int64_t ms)
+{
+  return {tpMax(int64_t(0), ms)};
+}
+
+//##################################################################################################
+//! Create a task that runs a coroutine.
+/*!
+The coroutine is created the first time that the task is run, with the task as its argument.
+
+\param taskName A user visible name for the task.
+\param coroutine Called with the Task& and returns a TaskCoroutine, this is kept by the task so a
+lambda can safely capture state for the coroutine.
+*/
+template<typename F>
+Task* makeCoroutineTask(const std::string& taskName,
+                        F coroutine,
+                        bool pauseable=false,
+                        TaskPriority priority=TaskPriority::Normal)
+{
+  struct State
+  {
+    F coroutine;
+    std::optional<TaskCoroutine> taskCoroutine;
+  };
+
+  auto state = std::make_unique<State>(State{std::move(coroutine), {}});
+  return new Task(taskName, [state=std::move(state)](Task& task)
+  {
+    if(!state->taskCoroutine)
+      state->taskCoroutine.emplace(state->coroutine(task));
+    return state->taskCoroutine->resume(task);
+  }, 0, std::string(), pauseable, priority);
+}
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef tp_task_queue_Future_h
+#define tp_task_queue_Future_h
+
+#include "tp_task_queue/InplaceFunction.h"
+
+#include "tp_utils/MutexUtils.h"
+
+#include <exception>
+#include <future>
+#include <memory>
+#include <optional>
+#include <type_traits>
+
+namespace tp_task_queue
+{
+template<typename T> class Future;
+template<typename T> class Promise;
+
+//##################################################################################################
+//! The state shared between a Promise and its Future.
+template<typename T>
+struct FutureState
+{
+  TP_NONCOPYABLE(FutureState);
+  FutureState()=default;
+
+  using Value = std::conditional_t<std::is_void_v<T>, bool, T>;
+
+  TPMutex mutex{TPM};
+  TPWaitCondition waitCondition;
+  bool ready{false};
+  std::optional<Value> value;
+  std::exception_ptr exception;
+  InplaceFunction<void()> continuation;
+
+  //################################################################################################
+  //! Mark the state as ready and run the continuation on this thread, if there is one.
+  void complete()
+  {
+    InplaceFunction<void()> c;
+    {
+      TP_MUTEX_LOCKER(mutex);
+      ready = true;
+      c = std::move(continuation);
+      waitCondition.wakeAll();
+    }
+
+    if(c)
+      c();
+  }
+
+  //################################################################################################
+  //! Set the continuation, if the state is already ready it is run now on this thread.
+  void setContinuation(InplaceFunction<void()> c)
+  {
+    {
+      TP_MUTEX_LOCKER(mutex);
+      if(!ready)
+      {
+        continuation = std::move(c);
+        return;
+      }
+    }
+
+    c();
+  }
+};
+
+//##################################################################################################
+//! The result of a task, see TaskQueue::submit.
+/*!
+A future has a single consumer, either call get or attach one continuation with then. Both leave
+the future invalid.
+*/
+template<typename T>
+class Future
+{
+  friend class Promise<T>;
+  template<typename> friend class Future;
+  std::shared_ptr<FutureState<T>> sharedState;
+
+  //################################################################################################
+  Future(std::shared_ptr<FutureState<T>> state):
+    sharedState(std::move(state))
+  {
+
+  }
+
+public:
+  //################################################################################################
+  Future()=default;
+
+  //################################################################################################
+  //! Returns true if this refers to a result that has not been consumed.
+  bool valid() const
+  {
+    return sharedState!=nullptr;
+  }
+
+  //################################################################################################
+  bool isReady() const
+  {
+    TP_MUTEX_LOCKER(sharedState->mutex);
+    return sharedState->ready;
+  }
+
+  //################################################################################################
+  //! Block until the result is ready.
+  void wait() const
+  {
+    TPMutexLocker lock(sharedState->mutex);
+    while(!sharedState->ready)
+      sharedState->waitCondition.wait(TPMc lock);
+  }
+
+  //################################################################################################
+  //! Call f with no arguments once the result is ready, leaving it to be collected with get.
+  /*!
+  This uses the same slot as then so use one or the other. Like then, f runs on the thread that
+  completes the future or straight away if it is already ready.
+  */
+  template<typename F>
+  void whenReady(F f)
+  {
+    sharedState->setContinuation(std::move(f));
+  }
+
+  //################################################################################################
+  //! Wait for the result and return it, this rethrows any exception thrown by the task.
+  T get()
+  {
+    wait();
+    auto state = std::move(sharedState);
+    if(state->exception)
+      std::rethrow_exception(state->exception);
+
+    if constexpr(!std::is_void_v<T>)
+      return std::move(*state->value);
+  }
+
+  //################################################################################################
+  //! Call f with the result once it is ready.
+  /*!
+  The continuation runs on the thread that completes this future, normally the worker that ran
+  the task, or straight away on this thread if the result is already ready. It should be short,
+  use the overload that takes an executor for anything heavy. If the task threw, f is not called
+  and the exception is passed on to the returned future.
+
+  \return A future for the result of f.
+  */
+  template<typename F>
+  auto then(F f)
+  {
+    using U = typename Promise<T>::template ResultOf<F>;
+    Promise<U> promise;
+    auto future = promise.future();
+    auto state = sharedState;
+    sharedState.reset();
+    state->setContinuation(makeContinuation(state, std::move(promise), std::move(f)));
+    return future;
+  }
+
+  //################################################################################################
+  //! Call f with the result by posting it to an executor such as a TaskQueue.
+  /*!
+  The post is made from the thread that completes this future, so with a work stealing TaskQueue
+  the continuation goes on to the local deque of the worker that ran the task.
+  */
+  template<typename Executor, typename F>
+  auto then(Executor& executor, F f)
+  {
+    using U = typename Promise<T>::template ResultOf<F>;
+    Promise<U> promise;
+    auto future = promise.future();
+    auto state = sharedState;
+    sharedState.reset();
+    auto continuation = makeContinuation(state, std::move(promise), std::move(f));
+    state->setContinuation([&executor, c=std::move(continuation)]() mutable
+    {
+      executor.post(std::move(c));
+    });
+    return future;
+  }
+
+private:
+  //################################################################################################
+  //! The continuation holds the state until it has run, which breaks the reference cycle.
+  template<typename U, typename F>
+  static InplaceFunction<void()> makeContinuation(std::shared_ptr<FutureState<T>> state,
+                                                  Promise<U> promise,
+                                                  F f)
+  {
+    return [state=std::move(state), promise=std::move(promise), f=std::move(f)]() mutable
+    {
+      if(state->exception)
+        promise.setException(state->exception);
+      else if constexpr(std::is_void_v<T>)
+        promise.setResultOf(f);
+      else
+        promise.setResultOf(f, std::move(*state->value));
+    };
+  }
+};
+
+//##################################################################################################
+//! The producer side of a Future.
+/*!
+If a promise is destroyed without a result its future receives a std::future_error with
+std::future_errc::broken_promise, for example if the closure never ran because the queue was
+destroyed.
+*/
+template<typename T>
+class Promise
+{
+  std::shared_ptr<FutureState<T>> sharedState{std::make_shared<FutureState<T>>()};
+
+public:
+  //! The type returned by calling F with the value of a Future<T>.
+  template<typename F>
+  using ResultOf = typename std::conditional_t<std::is_void_v<T>,
+                                               std::invoke_result<F&>,
+                                               std::invoke_result<F&, T>>::type;
+
+  //################################################################################################
+  Promise()=default;
+
+  //################################################################################################
+  Promise(Promise&&) noexcept = default;
+
+  //################################################################################################
+  Promise& operator=(Promise&& other) noexcept
+  {
+    if(&other != this)
+    {
+      breakPromise();
+      sharedState = std::move(other.sharedState);
+    }
+    return *this;
+  }
+
+  //################################################################################################
+  ~Promise()
+  {
+    breakPromise();
+  }
+
+  //################################################################################################
+  //! Returns the future for this promise, call this once.
+  Future<T> future() const
+  {
+    return Future<T>(sharedState);
+  }
+
+  //################################################################################################
+  template<typename... V>
+  void setValue(V&&... value)
+  {
+    auto state = std::move(sharedState);
+    if constexpr(std::is_void_v<T>)
+      state->value.emplace(true);
+    else
+      state->value.emplace(std::forward<V>(value)...);
+    state->complete();
+  }
+
+  //################################################################################################
+  void setException(std::exception_ptr exception)
+  {
+    auto state = std::move(sharedState);
+    state->exception = std::move(exception);
+    state->complete();
+  }
+
+  //################################################################################################
+  //! Call f with args and set the result, or the exception that it throws.
+  template<typename F, typename... Args>
+  void setResultOf(F& f, Args&&... args)
+  {
+    // Only f is guarded, anything thrown by a continuation run from setValue goes to the caller.
+    if constexpr(std::is_void_v<T>)
+    {
+      try
+      {
+        std::invoke(f, std::forward<Args>(args)...);
+      }
+      catch(...)
+      {
+        setException(std::current_exception());
+        return;
+      }
+      setValue();
+    }
+    else
+    {
+      std::optional<T> result;
+      try
+      {
+        result.emplace(std::invoke(f, std::forward<Args>(args)...));
+      }
+      catch(...)
+      {
+        setException(std::current_exception());
+        return;
+      }
+      setValue(std::move(*result));
+    }
+  }
+
+private:
+  //################################################################################################
+  void breakPromise()
+  {
+    if(sharedState)
+      setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef tp_task_queue_InplaceFunction_h
+#define tp_task_queue_InplaceFunction_h
+
+#include "tp_task_queue/Globals.h" // IWYU pragma: keep
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace tp_task_queue
+{
+
+//##################################################################################################
+template<typename Signature, size_t Capacity=64>
+class InplaceFunction;
+
+//##################################################################################################
+//! A move only callable that stores small closures without allocating.
+/*!
+Closures of up to Capacity bytes that can be moved without throwing are stored inline, larger ones
+are moved onto the heap. Unlike std::function the closure does not need to be copyable so it can
+capture things like std::unique_ptr or std::promise. A std::function can be passed in where an
+InplaceFunction is expected, it is simply stored as the closure.
+*/
+template<typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity>
+{
+  struct VTable
+  {
+    R (*invoke)(void* buffer, Args&&... args);
+    void (*move)(void* from, void* to);
+    void (*destroy)(void* buffer);
+  };
+
+  template<typename F>
+  static constexpr bool storedInline = sizeof(F)<=Capacity &&
+                                       alignof(F)<=alignof(std::max_align_t) &&
+                                       std::is_nothrow_move_constructible_v<F>;
+
+  template<typename D>
+  static constexpr bool acceptsCallable = !std::is_same_v<D, InplaceFunction> &&
+                                          std::is_invocable_r_v<R, D&, Args...>;
+
+public:
+  //################################################################################################
+  InplaceFunction() noexcept = default;
+
+  //################################################################################################
+  InplaceFunction(std::nullptr_t) noexcept {}
+
+  //################################################################################################
+  template<typename F,
+           typename D = std::decay_t<F>,
+           typename = std::enable_if_t<acceptsCallable<D>>>
+  InplaceFunction(F&& f)
+  {
+    if(isNull(f))
+      return;
+
+    if constexpr(storedInline<D>)
+      new (storage) D(std::forward<F>(f));
+    else
+      new (storage) D*(new D(std::forward<F>(f)));
+
+    vtable = vtableFor<D>();
+  }
+
+  //################################################################################################
+  InplaceFunction(InplaceFunction&& other) noexcept
+  {
+    moveFrom(other);
+  }
+
+  //################################################################################################
+  InplaceFunction(const InplaceFunction&) = delete;
+
+  //################################################################################################
+  ~InplaceFunction()
+  {
+    reset();
+  }
+
+  //################################################################################################
+  InplaceFunction& operator=(InplaceFunction&& other) noexcept
+  {
+    if(&other != this)
+    {
+      reset();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  //################################################################################################
+  InplaceFunction& operator=(const InplaceFunction&) = delete;
+
+  //################################################################################################
+  InplaceFunction& operator=(std::nullptr_t) noexcept
+  {
+    reset();
+    return *this;
+  }
+
+  //################################################################################################
+  template<typename F,
+           typename D = std::decay_t<F>,
+           typename = std::enable_if_t<acceptsCallable<D>>>
+  InplaceFunction& operator=(F&& f)
+  {
+    return *this = InplaceFunction(std::forward<F>(f));
+  }
+
+  //################################################################################################
+  //! Calls the closure, throws std::bad_function_call if this is empty.
+  R operator()(Args... args)
+  {
+    if(!vtable)
+      throw std::bad_function_call();
+
+    return vtable->invoke(storage, std::forward<Args>(args)...);
+  }
+
+  //################################################################################################
+  explicit operator bool() const noexcept
+  {
+    return vtable!=nullptr;
+  }
+
+private:
+  //################################################################################################
+  template<typename F>
+  static bool isNull(const F&)
+  {
+    return false;
+  }
+
+  //################################################################################################
+  template<typename F>
+  static bool isNull(F* f)
+  {
+    return f==nullptr;
+  }
+
+  //################################################################################################
+  template<typename Signature>
+  static bool isNull(const std::function<Signature>& f)
+  {
+    return !f;
+  }
+
+  //################################################################################################
+  template<typename D>
+  static const VTable* vtableFor()
+  {
+    if constexpr(storedInline<D>)
+    {
+      static const VTable table
+      {
+        [](void* buffer, Args&&... args) -> R
+        {
+          // Like std::function a void signature discards the result of the callable.
+          if constexpr(std::is_void_v<R>)
+            std::invoke(*static_cast<D*>(buffer), std::forward<Args>(args)...);
+          else
+            return std::invoke(*static_cast<D*>(buffer), std::forward<Args>(args)...);
+        },
+        [](void* from, void* to)
+        {
+          new (to) D(std::move(*static_cast<D*>(from)));
+          static_cast<D*>(from)->~D();
+        },
+        [](void* buffer)
+        {
+          static_cast<D*>(buffer)->~D();
+        }
+      };
+      return &table;
+    }
+    else
+    {
+      static const VTable table
+      {
+        [](void* buffer, Args&&... args) -> R
+        {
+          // Like std::function a void signature discards the result of the callable.
+          if constexpr(std::is_void_v<R>)
+            std::invoke(**static_cast<D**>(buffer), std::forward<Args>(args)...);
+          else
+            return std::invoke(**static_cast<D**>(buffer), std::forward<Args>(args)...);
+        },
+        [](void* from, void* to)
+        {
+          new (to) D*(*static_cast<D**>(from));
+        },
+        [](void* buffer)
+        {
+          delete *static_cast<D**>(buffer);
+        }
+      };
+      return &table;
+    }
+  }
+
+  //################################################################################################
+  void moveFrom(InplaceFunction& other) noexcept
+  {
+    if(other.vtable)
+    {
+      other.vtable->move(other.storage, storage);
+      vtable = other.vtable;
+      other.vtable = nullptr;
+    }
+  }
+
+  //################################################################################################
+  void reset() noexcept
+  {
+    if(vtable)
+    {
+      vtable->destroy(storage);
+      vtable = nullptr;
+    }
+  }
+
+  const VTable* vtable{nullptr};
+  alignas(std::max_align_t) unsigned char storage[Capacity];
+};
+
+}
+
+#endif
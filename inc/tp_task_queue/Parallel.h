@@ -0,0 +1,63 @@
+#ifndef tp_task_queue_Parallel_h
+#define tp_task_queue_Parallel_h
+
+#include "tp_task_queue/Globals.h" // IWYU pragma: keep
+
+#include "tp_utils/MutexUtils.h"
+
+#include <functional>
+
+namespace tp_task_queue
+{
+class TaskQueue;
+
+//##################################################################################################
+//! Call f for sub ranges of [begin, end) on the threads of a task queue and the calling thread.
+/*!
+The range is handed out in chunks that start large and shrink as the remaining work runs out, but
+are never smaller than grain. Helpers are added with TaskQueue::post so no Task or TaskStatus is
+created, and the calling thread takes chunks too rather than blocking, so this can safely be called
+from inside a task running on the same queue.
+
+If f throws the remaining chunks are abandoned and the first exception is rethrown once every
+thread has stopped calling f.
+
+\param f Called as f(chunkBegin, chunkEnd) for each chunk, the chunks may run in any order.
+*/
+TP_TASK_QUEUE_EXPORT void parallelFor(TaskQueue& taskQueue,
+                                      size_t begin,
+                                      size_t end,
+                                      size_t grain,
+                                      const std::function<void(size_t, size_t)>& f);
+
+//##################################################################################################
+//! Reduce [begin, end) in parallel, see parallelFor for how the range is split.
+/*!
+\param identity The initial value of the partial result of each chunk and of the result.
+\param f Called as f(chunkBegin, chunkEnd, identity) to return the partial result of a chunk.
+\param combine Called as combine(a, b) to merge two results, this must be associative and
+commutative as partial results are combined in the order that they finish.
+*/
+template<typename T, typename F, typename Combine>
+T parallelReduce(TaskQueue& taskQueue,
+                 size_t begin,
+                 size_t end,
+                 size_t grain,
+                 const T& identity,
+                 const F& f,
+                 const Combine& combine)
+{
+  TPMutex mutex{TPM};
+  T result = identity;
+  parallelFor(taskQueue, begin, end, grain, [&](size_t chunkBegin, size_t chunkEnd)
+  {
+    T partial = f(chunkBegin, chunkEnd, identity);
+    TP_MUTEX_LOCKER(mutex);
+    result = combine(std::move(result), std::move(partial));
+  });
+  return result;
+}
+
+}
+
+#endif
@@ -21,8 +21,8 @@ class SynchronizationPoint
 public:
   //################################################################################################
   /*!
-  The taskRemoved callback must be thread safe and can't call addTask directly as it is being called
-  from a task thread.
+  The taskRemoved callback must be thread safe as it is called from a task thread. It is called
+  without the lock held so it may add tasks, join waits for it to return.
   */
   SynchronizationPoint(const std::function<void()>& taskRemoved={});
 
@@ -30,15 +30,23 @@ public:
   ~SynchronizationPoint();
 
   //################################################################################################
+  //! Wait for all of the tasks to finish.
+  /*!
+  If this is called from a worker thread of the queue that the tasks were added to, the worker runs
+  other pending tasks from that queue while it waits, tasks on this synchronization point first.
+  This stops a small pool deadlocking when tasks wait for tasks.
+  */
   void join();
 
   //################################################################################################
+  //! Add a task, blocking while there are already maxActive tasks, this helps like join.
   void addTask(Task* task, size_t maxActive=std::numeric_limits<size_t>::max());
 
   //################################################################################################
   void cancelTasks();
 
   //################################################################################################
+  //! The number of tasks that have not finished, this does not lock.
   size_t activeTasks();
 
 private:
@@ -2,9 +2,12 @@
 #define tp_task_queue_Task_h
 
 #include "tp_task_queue/Globals.h" // IWYU pragma: keep
+#include "tp_task_queue/InplaceFunction.h"
 
 #include "tp_utils/RefCount.h"
 
+#include <exception>
+#include <new>
 #include <string>
 
 namespace tp_task_queue
@@ -12,29 +15,67 @@ namespace tp_task_queue
 class Task;
 class TaskQueue;
 class SynchronizationPoint;
+class TaskGraph;
+template<typename T> class Future;
 
 //##################################################################################################
 enum class RunAgain
 {
-  Yes,
-  No
+  Yes,    //!< Run again after timeoutMS, tasks without a timeout are finished.
+  No,     //!< The task is finished.
+  Suspend //!< Keep the task but don't run it again until TaskQueue::resumeTask is called.
+};
+
+//##################################################################################################
+//! The order that ready tasks are run in, higher priorities are run first.
+enum class TaskPriority
+{
+  Low,
+  Normal,
+  High,
+  Critical
+};
+
+//! The number of values in TaskPriority.
+constexpr size_t numberOfTaskPriorities=4;
+
+//##################################################################################################
+//! How a periodic task is rescheduled after it returns RunAgain::Yes.
+enum class TimerMode
+{
+  FixedDelay,   //!< Run again timeoutMS after this run finished, the period drifts by the run time.
+  FixedRate,    //!< Run again timeoutMS after the last deadline, missed deadlines run at once.
+  FixedRateSkip //!< As FixedRate but deadlines that have already been missed are skipped.
 };
 
 //##################################################################################################
 using TaskCallback = std::function<RunAgain(Task&)>;
 
+//##################################################################################################
+//! The move only form of TaskCallback that tasks store, a TaskCallback can be passed as one.
+using TaskFunction = InplaceFunction<RunAgain(Task&)>;
+
 //##################################################################################################
 //! The status of a running task.
 struct TaskStatus
 {
   int64_t taskID{0};    //!< The unique ID assigned to the task when it is created.
-  int64_t rev{0};       //!< Incremented each time the status changes.
+  int64_t rev{0};       //!< The revision of the last change, see TaskQueue::taskStatusChangesSince.
   std::string taskName; //!< The name give to the task eg. 'Save models'.
   std::string message;  //!< Some message eg. 'Next save in 10s' or 'Saving model 5'.
   int progress{-1};     //!< The current progress as a percent or -1 where not aplicable.
   bool complete{false}; //!< Set true when the task has been completed.
   bool pauseable{false};//!< True if the task can be paused.
   bool paused{false};   //!< True if the task is paused.
+  TaskPriority priority{TaskPriority::Normal}; //!< The priority that the task runs at.
+};
+
+//##################################################################################################
+//! Links a task into the list of tasks held by a SynchronizationPoint.
+struct SynchronizationPointLinks
+{
+  Task* previous{nullptr};
+  Task* next{nullptr};
 };
 
 //##################################################################################################
@@ -52,14 +93,46 @@ public:
   Constructs a task that can be added to a task queue for processing.
 
   \param taskName A user visible name for the task.
-  \param performTask A function to call to perform the task, return true to rerun the task.
+  \param performTask A function to call to perform the task, return true to rerun the task. This
+  is moved into the task so it can hold move only captures.
   \param timeoutMS If this is positive the task will be rerun at this interval.
+  \param priority Ready tasks with a higher priority are run first.
+
+  This used to take a const TaskCallback&. A TaskCallback still converts to a TaskFunction so code
+  recompiles unchanged, but binaries built against the old constructor must be rebuilt. An
+  overload for the old signature is not kept as a lambda would then be ambiguous between the two.
   */
-  Task(const std::string& taskName, const TaskCallback& performTask, int64_t timeoutMS=0, const std::string& timeoutMessage=std::string(), bool pauseable=false);
+  Task(const std::string& taskName,
+       TaskFunction performTask,
+       int64_t timeoutMS=0,
+       const std::string& timeoutMessage=std::string(),
+       bool pauseable=false,
+       TaskPriority priority=TaskPriority::Normal);
 
   //################################################################################################
   ~Task();
 
+  //################################################################################################
+  //! Tasks created with new are allocated in a single block along with their private data.
+  static void* operator new(size_t size);
+
+  //################################################################################################
+  static void operator delete(void* ptr);
+
+  //################################################################################################
+  //! Like operator new but returns nullptr if the allocation fails.
+  static void* operator new(size_t size, const std::nothrow_t&) noexcept;
+
+  //################################################################################################
+  static void operator delete(void* ptr, const std::nothrow_t&) noexcept;
+
+  //################################################################################################
+  //! Construct a task in storage owned by the caller, the private data is allocated separately.
+  static void* operator new(size_t size, void* place) noexcept;
+
+  //################################################################################################
+  static void operator delete(void* ptr, void* place) noexcept;
+
   //################################################################################################
   //! A unique ID assigned to the task when it is created.
   int64_t taskID() const;
@@ -73,6 +146,19 @@ public:
   //################################################################################################
   void setTimeoutMS(int64_t timeoutMS);
 
+  //################################################################################################
+  TimerMode timerMode() const;
+
+  //################################################################################################
+  //! Set how the task is rescheduled, the default is TimerMode::FixedDelay.
+  /*!
+  Use FixedRate or FixedRateSkip for samplers that need to run on a regular grid of deadlines.
+  With FixedRate a task that falls behind, including while it is paused, runs back to back until
+  it has caught up, FixedRateSkip runs it once and moves on to the next deadline that has not
+  passed. Deadlines are kept on a monotonic clock with microsecond resolution.
+  */
+  void setTimerMode(TimerMode timerMode);
+
   //################################################################################################
   const std::string& timeoutMessage() const;
 
@@ -85,6 +171,33 @@ public:
   //################################################################################################
   void setPaused(bool paused);
 
+  //################################################################################################
+  TaskPriority priority() const;
+
+  //################################################################################################
+  //! Set the priority, this takes effect the next time that the task becomes ready to run.
+  void setPriority(TaskPriority priority);
+
+  //################################################################################################
+  int numaNode() const;
+
+  //################################################################################################
+  //! Hint which NUMA node owns the memory that this task works on, or -1 for no preference.
+  /*!
+  When the queue has NUMA placement enabled workers on this node take the task before others.
+  */
+  void setNUMANode(int numaNode);
+
+  //################################################################################################
+  const std::string& concurrencyGroup() const;
+
+  //################################################################################################
+  //! Put the task in a concurrency group of the queue, see TaskQueue::setConcurrencyLimit.
+  /*!
+  This should only be called before the task is added to a queue, an empty name is no group.
+  */
+  void setConcurrencyGroup(const std::string& concurrencyGroup);
+
   //################################################################################################
   //! Returns true if the task should finish now.
   bool shouldFinish() const;
@@ -101,6 +214,13 @@ public:
   //! This is used to get task status for the UI
   TaskStatus taskStatus()const;
 
+  //################################################################################################
+  //! Refresh a status previously filled in by this, the strings are only copied if they changed.
+  /*!
+  \param messageRevision Set to the revision of the message that was copied, pass -1 to copy it.
+  */
+  void copyTaskStatus(TaskStatus& taskStatus, int64_t& messageRevision)const;
+
   //################################################################################################
   //! Task callbacks should call this to update the UI with progress
   void updateTaskStatus(const TaskStatus& taskStatus);
@@ -109,10 +229,22 @@ public:
   //! Task callbacks should call this to update the UI with progress
   void updateTaskStatus(const std::string& message, int progress);
 
+  //################################################################################################
+  //! Update just the progress, this does not lock or touch the message.
+  void updateTaskProgress(int progress);
+
   //################################################################################################
   //! This should only be called before performTask is called.
   void setStatusChangedCallback(std::function<void(const TaskStatus&)> statusChangedCallback);
 
+  //################################################################################################
+  //! Called with the task after each status change, use copyTaskStatus to read it.
+  /*!
+  Unlike setStatusChangedCallback no TaskStatus is built for each change, this replaces a callback
+  set with that. This should only be called before performTask is called.
+  */
+  void setTaskStatusChangedCallback(std::function<void(const Task&)> taskStatusChangedCallback);
+
   //################################################################################################
   //! This should only be called before performTask is called.
   void setTaskQueue(TaskQueue* taskQueue);
@@ -120,9 +252,32 @@ public:
   //################################################################################################
   TaskQueue* taskQueue()const;
 
+  //################################################################################################
+  //! The synchronization point that this task has been added to, if any.
+  SynchronizationPoint* synchronizationPoint() const;
+
+  //################################################################################################
+  //! Returns a future that becomes ready when this task is deleted, either finished or cancelled.
+  /*!
+  Call this once, before the task is added to a queue. Coroutine tasks can co_await the result
+  to wait for another task without blocking a worker. Include tp_task_queue/Future.h to use it.
+  */
+  Future<void> finished();
+
+  //################################################################################################
+  //! Record that the task failed, the future from finished rethrows this once the task is deleted.
+  /*!
+  If nothing called finished the exception is logged when the task is deleted instead.
+  */
+  void setException(std::exception_ptr exception);
+
 private:
   friend class SynchronizationPoint;
   void setSynchronizationPoint(SynchronizationPoint* synchronizationPoint);
+  SynchronizationPointLinks& synchronizationPointLinks();
+
+  friend class TaskGraph;
+  void setTaskGraph(TaskGraph* taskGraph, size_t node);
 };
 
 }
@@ -0,0 +1,72 @@
+#ifndef tp_task_queue_TaskGraph_h
+#define tp_task_queue_TaskGraph_h
+
+#include "tp_task_queue/Globals.h" // IWYU pragma: keep
+
+#include "tp_utils/RefCount.h"
+
+#include <vector>
+
+namespace tp_task_queue
+{
+class Task;
+class TaskQueue;
+
+//##################################################################################################
+//! Runs a set of tasks on a TaskQueue in dependency order.
+/*!
+Each node is a Task that is added to the queue as soon as the last of its predecessors has
+finished, so no thread is blocked waiting for dependencies. Predecessors must be added before their
+successors which keeps the graph acyclic.
+
+If the task of a node is cancelled with Task::cancelTask the nodes that depend on it are not run,
+cancel does this for the whole graph. Tasks that are not run are deleted by the graph.
+*/
+class TP_TASK_QUEUE_EXPORT TaskGraph
+{
+  TP_NONCOPYABLE(TaskGraph);
+  TP_REF_COUNT_OBJECTS("TaskGraph");
+  TP_DQ;
+public:
+  //################################################################################################
+  TaskGraph(TaskQueue* taskQueue);
+
+  //################################################################################################
+  //! Waits for running nodes to finish, nodes that have not started are deleted.
+  ~TaskGraph();
+
+  //################################################################################################
+  //! Add a node to the graph, this must be called before run.
+  /*!
+  \param task The task to run for this node, this will take ownership.
+  \param predecessors The nodes that must finish before this one is started.
+  \return The index of the new node to use as a predecessor of later nodes.
+  */
+  size_t addNode(Task* task, const std::vector<size_t>& predecessors={});
+
+  //################################################################################################
+  //! Start the nodes that have no predecessors, this can only be called once.
+  void run();
+
+  //################################################################################################
+  //! Block until every node has either finished or been skipped.
+  void join();
+
+  //################################################################################################
+  //! Cancel the running tasks and skip the nodes that have not started.
+  void cancel();
+
+  //################################################################################################
+  bool cancelled() const;
+
+  //################################################################################################
+  size_t numberOfNodes() const;
+
+private:
+  friend class Task;
+  void taskFinished(size_t node, bool cancelled);
+};
+
+}
+
+#endif
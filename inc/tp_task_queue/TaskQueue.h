@@ -2,10 +2,61 @@
 #define tp_task_queue_TaskQueue_h
 
 #include "tp_task_queue/Task.h"
+#include "tp_task_queue/Future.h"
+
+#include <memory>
+#include <vector>
 
 namespace tp_task_queue
 {
 
+//##################################################################################################
+//! How the worker threads of a TaskQueue find tasks to run.
+enum class SchedulingMode
+{
+  Shared,      //!< All workers take tasks from a single queue.
+  WorkStealing //!< Each worker has its own deque and idle workers steal from the others.
+};
+
+//##################################################################################################
+//! What TaskQueue::shutdown does with the tasks that are still in the queue.
+enum class ShutdownMode
+{
+  Drain,         //!< Run until nothing is ready, running or suspended, new tasks are still run.
+  FinishRunning, //!< Let the running tasks finish but don't start any more.
+  Cancel         //!< Cancel the running tasks with Task::cancelTask and don't start any more.
+};
+
+//##################################################################################################
+//! The task statuses that have changed since a given revision.
+struct TaskStatusChanges
+{
+  int64_t rev{0};                      //!< The current revision, pass this in to the next call.
+  bool reset{false};                   //!< True if statuses contains every task, discard old state.
+  std::vector<TaskStatus> statuses;    //!< Statuses that have been added or changed.
+  std::vector<int64_t> removedTaskIDs; //!< The IDs of tasks that have been removed.
+};
+
+//##################################################################################################
+//! Runtime metrics for a TaskQueue, see TaskQueue::statistics.
+/*!
+Queue wait is the time from a task becoming ready to it starting, for timers this is measured from
+when they were due. Percentiles come from power of two histograms so they are approximate.
+*/
+struct TaskQueueStatistics
+{
+  int64_t elapsedMS{0};          //!< How long statistics have been collected for.
+  size_t tasksRun{0};            //!< Tasks and posted closures that have been run.
+  size_t reschedules{0};         //!< Runs that returned RunAgain::Yes and were scheduled again.
+  size_t wakeups{0};             //!< The number of times that a parked worker woke up.
+  double tasksPerSecond{0.0};
+  double workerUtilization{0.0}; //!< The fraction of worker time spent running tasks, 0 to 1.
+  double queueWaitP50US{0.0};
+  double queueWaitP99US{0.0};
+  double runTimeP50US{0.0};
+  double runTimeP99US{0.0};
+};
+
 //##################################################################################################
 class TP_TASK_QUEUE_EXPORT TaskQueue
 {
@@ -13,17 +64,204 @@ class TP_TASK_QUEUE_EXPORT TaskQueue
   TP_DQ;
 public:
   //################################################################################################
-  TaskQueue(const std::string& threadName, size_t nThreads=1);
+  /*!
+  \param threadName The name given to the worker threads.
+  \param nThreads The number of worker threads to start.
+  \param schedulingMode In WorkStealing mode tasks that are added from inside a running task go
+  onto the deque of that worker rather than the shared queue.
+  */
+  TaskQueue(const std::string& threadName,
+            size_t nThreads=1,
+            SchedulingMode schedulingMode=SchedulingMode::Shared);
 
   //################################################################################################
+  //! Calls shutdown with ShutdownMode::Cancel and deletes the tasks that it returns.
+  /*!
+  This must not be called from a task or callback running on one of the queue's own threads, as it
+  would wait for itself to finish. Doing so aborts.
+  */
   ~TaskQueue();
 
+  //################################################################################################
+  //! Stop the queue and hand back the tasks that have not run.
+  /*!
+  The worker threads are joined before this returns. Tasks that have not started, paused tasks and
+  periodic tasks waiting for their next run are returned so that they can be persisted or added to
+  another queue, the caller takes ownership of them. Coroutine tasks that suspended part way
+  through and cancelled tasks are deleted, posted closures that have not run are destroyed.
+
+  If the timeout passes first the running tasks are cancelled, they can't be interrupted so this
+  still waits for them to return. Once this has been called tasks that are added are deleted.
+
+  A queue with no worker threads and no adaptive pool has nothing to drain with, Drain then hands
+  back the queued tasks straight away as Cancel does rather than waiting for the timeout.
+
+  This must not be called from the queue's own worker or admin threads, or from a task that is run
+  by runPendingTask, as it waits for those to finish. Such calls are ignored and return nothing.
+
+  \param mode How much of the remaining work to do before stopping.
+  \param timeoutMS How long to wait for the mode to complete, or -1 for no limit.
+  \return The tasks that were not run, this is empty if the queue has already been shut down.
+  */
+  std::vector<Task*> shutdown(ShutdownMode mode, int64_t timeoutMS=-1);
+
   //################################################################################################
   size_t numberOfTaskThreads() const;
 
   //################################################################################################
   void setNumberOfTaskThreads(size_t numberOfTaskThreads);
 
+  //################################################################################################
+  //! Let the pool size itself between a minimum and maximum number of threads.
+  /*!
+  A thread is added when ready tasks have been waiting for about 10ms with no idle worker, for
+  example because the workers are blocked, and a thread exits after it has been idle for a couple
+  of seconds. The admin thread times the wait, while it is disabled a thread is added as soon as a
+  backlog is seen. The current thread count is clamped into the range and setNumberOfTaskThreads can
+  still be used to move it. Pass a maximum of zero to turn this off, which is the default.
+  */
+  void setAdaptiveThreads(size_t minimumThreads, size_t maximumThreads);
+
+  //################################################################################################
+  size_t minimumThreads() const;
+
+  //################################################################################################
+  size_t maximumThreads() const;
+
+  //################################################################################################
+  int64_t idleSpinUS() const;
+
+  //################################################################################################
+  //! Set how long idle workers spin looking for work before they park, in microseconds.
+  /*!
+  Spinning saves a sleep and wake for back to back short tasks at the cost of some CPU time while
+  the queue is idle, zero or less parks straight away. The default is 20us.
+  */
+  void setIdleSpinUS(int64_t idleSpinUS);
+
+  //################################################################################################
+  size_t taskPoolSize() const;
+
+  //################################################################################################
+  //! Set the number of completed task records that are kept for reuse.
+  /*!
+  Each task added to the queue needs a small amount of book keeping, with a pool size greater than
+  zero this is recycled rather than freed when the task completes which helps queues that process a
+  high rate of short tasks. The default is zero.
+  */
+  void setTaskPoolSize(size_t taskPoolSize);
+
+  //################################################################################################
+  std::vector<int> threadCPUs() const;
+
+  //################################################################################################
+  //! Pin the worker threads to a set of CPUs, an empty list removes the restriction.
+  /*!
+  This is applied by each worker the next time that it looks for work. Pinning is only implemented
+  on Linux, elsewhere it is ignored.
+  */
+  void setThreadCPUs(const std::vector<int>& threadCPUs);
+
+  //################################################################################################
+  bool numaPlacement() const;
+
+  //################################################################################################
+  //! Split the worker threads across the NUMA nodes of the machine.
+  /*!
+  Workers are assigned to nodes in turn and pinned to the CPUs of their node, if a CPU set has
+  been given with setThreadCPUs only those CPUs are used. Nodes without any usable CPUs, such as
+  gaps left by offline nodes, are skipped. Workers prefer ready tasks that have a matching
+  Task::setNUMANode hint, with fewer than two usable nodes this has no effect. This is only
+  implemented on Linux.
+  */
+  void setNUMAPlacement(bool numaPlacement);
+
+  //################################################################################################
+  int64_t priorityAgingMS() const;
+
+  //################################################################################################
+  //! Set how long a ready task waits before it is moved up a priority level.
+  /*!
+  Ready tasks are always taken from the highest priority that has any, aging stops a busy queue of
+  high priority tasks starving the rest. Zero or less disables aging. The default is 500ms.
+  */
+  void setPriorityAgingMS(int64_t priorityAgingMS);
+
+  //################################################################################################
+  size_t concurrencyLimit(const std::string& concurrencyGroup) const;
+
+  //################################################################################################
+  //! Limit how many tasks of a concurrency group run at the same time.
+  /*!
+  Groups let one pool serve different kinds of work, for example a "disk IO" group limited to 2
+  alongside unlimited CPU work. A task that reaches the front of the queue while its group is full
+  is set aside without blocking a worker, and is handed back to the ready queue as soon as a task
+  of the group finishes, so workers carry on with other tasks in the mean time. Tasks join a group
+  with Task::setConcurrencyGroup.
+
+  \param concurrencyGroup The name of the group, it is created if required.
+  \param maxActive The most tasks from the group that may run at once, zero for no limit.
+  */
+  void setConcurrencyLimit(const std::string& concurrencyGroup, size_t maxActive);
+
+  //################################################################################################
+  bool adminThreadEnabled() const;
+
+  //################################################################################################
+  //! Enable or disable the admin thread, it is enabled by default.
+  /*!
+  The admin thread updates the 'Next run in' and 'Paused.' messages of waiting tasks once a second
+  and delivers coalesced status notifications. Headless queues that nobody watches can disable it,
+  while it is disabled status notifications are always synchronous.
+
+  This can be called from a status callback that runs on the admin thread, the thread then exits
+  once the callback returns and is joined by the next call to this or by shutdown.
+  */
+  void setAdminThreadEnabled(bool adminThreadEnabled);
+
+  //################################################################################################
+  bool statisticsEnabled() const;
+
+  //################################################################################################
+  //! Start or stop collecting runtime metrics, this is disabled by default.
+  /*!
+  While enabled each run reads the clock a couple of times and updates counters that belong to the
+  worker thread, so the cost is small but not zero. Enabling resets the statistics.
+  */
+  void setStatisticsEnabled(bool statisticsEnabled);
+
+  //################################################################################################
+  //! Returns the metrics collected since statistics were enabled or last reset.
+  /*!
+  The counters are read without stopping the workers, so a snapshot taken while tasks are running
+  may be slightly inconsistent. Utilization is averaged over the current number of threads.
+  */
+  TaskQueueStatistics statistics() const;
+
+  //################################################################################################
+  //! Clear the statistics and start a new measurement period.
+  void resetStatistics();
+
+  //################################################################################################
+  bool tracingEnabled() const;
+
+  //################################################################################################
+  //! Start or stop recording a timeline of task execution, this is disabled by default.
+  /*!
+  Each thread that runs tasks records an event for every task, with its name and ID, and for every
+  time that it parks waiting for work. Events go into a fixed size ring per thread without taking
+  any locks, so only the most recent events are kept. Enabling clears anything recorded before.
+  */
+  void setTracingEnabled(bool tracingEnabled);
+
+  //################################################################################################
+  //! Returns the recorded events in the Chrome trace event JSON format.
+  /*!
+  Save this to a file and open it with chrome://tracing or ui.perfetto.dev. Worker threads are
+  shown with the name that they were given and a number, other threads are shown as helpers.
+  */
+  std::string traceJSON() const;
+
   //################################################################################################
   //! Add a task to the queue to be processed.
   /*!
@@ -32,8 +270,99 @@ public:
   */
   void addTask(Task* task);
 
+  //################################################################################################
+  //! Add a batch of tasks to the queue to be processed.
+  /*!
+  This is equivalent to calling addTask for each task but the queue is locked once, the statuses
+  are appended in one go and a single status changed notification is sent.
+  \param tasks The tasks to process, this will take ownership of all of them.
+  */
+  void addTasks(const std::vector<Task*>& tasks);
+
+  //################################################################################################
+  //! Add a closure to the queue to be run once.
+  /*!
+  This is a light weight alternative to addTask for short fire and forget work. The closure has no
+  task ID or status so it can't be paused or cancelled and is not reported by viewTaskStatus.
+  Closures that have not started when the queue is destroyed are discarded without being called.
+
+  \param closure The closure to call from a worker thread, this may hold move only captures. A
+  std::function converts to this, code written against the std::function form must be rebuilt but
+  not changed.
+  */
+  void post(InplaceFunction<void()> closure);
+
+  //################################################################################################
+  //! Run a closure on the queue and return a future for its result.
+  /*!
+  This is built on post, so the closure can't be paused or cancelled. Use Future::then to chain
+  dependent work, it runs on the worker that finished this closure without going back through
+  the queue.
+
+  \param closure Called with no arguments from a worker thread, its result or exception is passed
+  to the future.
+  */
+  template<typename F>
+  auto submit(F closure)
+  {
+    using T = std::invoke_result_t<F&>;
+    Promise<T> promise;
+    auto future = promise.future();
+    post([promise=std::move(promise), closure=std::move(closure)]() mutable
+    {
+      promise.setResultOf(closure);
+    });
+    return future;
+  }
+
+  //################################################################################################
+  //! Run one pending task on the calling thread, used to help while waiting for tasks to finish.
+  /*!
+  This takes a task that is ready to run and runs it as if it were a worker thread, it does not
+  wait for timers. Ready tasks that were added to the preferred synchronization point are taken
+  first, for work stealing queues tasks are also taken from the local deque of the calling worker
+  or stolen from the others.
+
+  \param preferred A synchronization point whose tasks should be run first, or nullptr.
+  \return True if a task was run, false if there was nothing ready.
+  */
+  bool runPendingTask(const SynchronizationPoint* preferred=nullptr);
+
+  //################################################################################################
+  //! Block a helping thread until there may be a pending task for it to run.
+  /*!
+  This returns straight away if there is work, otherwise it waits along with the idle workers and
+  returns when work is added, when the next timer is due or when wakeHelpers is called.
+
+  \param done Checked with the queue locked just before waiting, return true to not wait.
+  */
+  void waitForPendingTask(const std::function<bool()>& done);
+
+  //################################################################################################
+  //! Wake the threads that are in waitForPendingTask so that they check done again.
+  void wakeHelpers();
+
+  //################################################################################################
+  //! Schedule a task that returned RunAgain::Suspend to run again.
+  /*!
+  If the task is still running the resume is remembered and it is scheduled as soon as it
+  suspends, so this can be called from any thread at any time after the task has started. Resumed
+  tasks go through the ready queue like any other, paused tasks wait until they are un-paused.
+
+  \param taskID The task to resume, this does nothing if it is not suspended or running.
+  \param delayMS How long to wait before running the task, zero runs it as soon as possible.
+  */
+  void resumeTask(int64_t taskID, int64_t delayMS=0);
+
+  //################################################################################################
+  //! Returns true if this is called from one of the worker threads of this queue.
+  bool isWorkerThread() const;
+
   //################################################################################################
   //! Try to cancel a task
+  /*!
+  This asks the task to finish, a task that is suspended is resumed so that it can see this.
+  */
   void cancelTask(int64_t taskID);
 
   //################################################################################################
@@ -47,13 +376,51 @@ public:
   //################################################################################################
   //! View the progress of current tasks.
   /*!
-  While inside the closure the task status mutex is locked so keep it simple and do not call any
-  code that may update the task status.
+  The closure is called with the statuses from taskStatusSnapshot, so no lock is held while it runs
+  and tasks can update their status meanwhile. Statuses are in the order that the tasks were added.
 
   \param closure The closure that is called with the task statuses.
   */
   void viewTaskStatus(const std::function<void(const std::vector<TaskStatus>&)>& closure);
 
+  //################################################################################################
+  //! Returns an immutable copy of the current task statuses.
+  /*!
+  The copy is only rebuilt when a status has changed since the last call, readers can hold on to
+  it for as long as they like without blocking the tasks that update their status.
+  */
+  std::shared_ptr<const std::vector<TaskStatus>> taskStatusSnapshot();
+
+  //################################################################################################
+  //! Returns the statuses that have changed since a revision.
+  /*!
+  Each change to the task statuses bumps a revision counter and TaskStatus::rev records the
+  revision of the last change to that status. Pass 0 to get everything then pass the rev from the
+  previous result to get just the changes since then. If too many tasks have been removed since
+  the last call to track them individually reset is set and statuses contains every task.
+
+  Otherwise statuses are in revision order and the cost is in the number of changes rather than
+  the number of tasks.
+  */
+  TaskStatusChanges taskStatusChangesSince(int64_t rev);
+
+  //################################################################################################
+  int64_t statusChangedInterval() const;
+
+  //################################################################################################
+  //! Coalesce status changed notifications.
+  /*!
+  By default the status changed callbacks are called synchronously, from the thread that changed
+  the status, every time a status changes. If the interval is positive a change just marks the
+  status as dirty and the admin thread calls the callbacks at most once per interval, so a task
+  that reports progress in a tight loop does not spend its time in UI code. This has no effect
+  while the admin thread is disabled.
+
+  \param statusChangedInterval The minimum time between notifications in ms, eg. 16 or 100. Zero
+  restores synchronous notifications.
+  */
+  void setStatusChangedInterval(int64_t statusChangedInterval);
+
   //################################################################################################
   void addStatusChangedCallback(const std::function<void()>* statusChangedCallback);
 
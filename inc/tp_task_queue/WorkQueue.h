@@ -2,8 +2,7 @@
 #define tp_task_queue_WorkQueue_h
 
 #include "tp_task_queue/Globals.h"
-
-#include <functional>
+#include "tp_task_queue/InplaceFunction.h"
 
 namespace tp_task_queue
 {
@@ -25,9 +24,35 @@ public:
   //################################################################################################
   ~WorkQueue();
 
+  //################################################################################################
+  size_t batchSize() const;
+
+  //################################################################################################
+  //! Set the maximum number of closures that are run by each task added to the TaskQueue.
+  /*!
+  When WorkQueue is built on a TaskQueue each task added to it drains up to this many closures in
+  order before giving the thread back, this saves creating a Task for every closure. The default
+  is 1. This has no effect on a WorkQueue that has its own thread.
+  */
+  void setBatchSize(size_t batchSize);
+
+  //################################################################################################
+  int64_t batchTimeMS() const;
+
+  //################################################################################################
+  //! Stop a batch early once it has run for this long, zero or less for no limit.
+  /*!
+  At least one closure is always run, the default is 0.
+  */
+  void setBatchTimeMS(int64_t batchTimeMS);
+
   //################################################################################################
   //! Add a task to the queue to be processed.
-  void addTask(const std::function<void()>& task);
+  /*!
+  This is lock free and can be called from any number of threads, the worker is only woken if it
+  is waiting for work. The task is moved through the queue and may hold move only captures.
+  */
+  void addTask(InplaceFunction<void()> task);
 };
 
 }
@@ -0,0 +1,125 @@
+#include "tp_task_queue/Coroutine.h"
+
+#ifdef TP_TASK_QUEUE_COROUTINES
+
+namespace tp_task_queue
+{
+
+//##################################################################################################
+CoroutineResumer::CoroutineResumer(TaskQueue* taskQueue_, int64_t taskID_):
+  taskQueue(taskQueue_),
+  taskID(taskID_)
+{
+
+}
+
+//##################################################################################################
+void CoroutineResumer::resume(int64_t delayMS)
+{
+  TaskQueue* queue;
+  {
+    TP_MUTEX_LOCKER(mutex);
+    queue = taskQueue;
+    if(!queue)
+      return;
+    inFlight++;
+  }
+
+  // The resumer's mutex is dropped first so that resumeTask takes the queue mutex without inverting
+  // the lock order. detach waits on inFlight, so the queue stays valid until this returns.
+  queue->resumeTask(taskID, delayMS);
+
+  TP_MUTEX_LOCKER(mutex);
+  inFlight--;
+  if(inFlight==0)
+    waitCondition.wakeAll();
+}
+
+//##################################################################################################
+void CoroutineResumer::detach()
+{
+  TPMutexLocker lock(mutex);
+  taskQueue = nullptr;
+  while(inFlight>0)
+    waitCondition.wait(TPMc lock);
+}
+
+//##################################################################################################
+TaskCoroutine::TaskCoroutine(std::coroutine_handle<promise_type> handle_):
+  handle(handle_)
+{
+
+}
+
+//##################################################################################################
+TaskCoroutine::TaskCoroutine(TaskCoroutine&& other) noexcept:
+  handle(std::exchange(other.handle, nullptr))
+{
+
+}
+
+//##################################################################################################
+TaskCoroutine& TaskCoroutine::operator=(TaskCoroutine&& other) noexcept
+{
+  if(&other != this)
+  {
+    destroy();
+    handle = std::exchange(other.handle, nullptr);
+  }
+  return *this;
+}
+
+//##################################################################################################
+TaskCoroutine::~TaskCoroutine()
+{
+  destroy();
+}
+
+//##################################################################################################
+RunAgain TaskCoroutine::resume(Task& task)
+{
+  if(!handle || handle.done())
+    return RunAgain::No;
+
+  promise_type& promise = handle.promise();
+  if(!promise.resumer)
+    promise.resumer = std::make_shared<CoroutineResumer>(task.taskQueue(), task.taskID());
+
+  if(task.shouldFinish())
+    return RunAgain::No;
+
+  promise.resumeDelayMS = -1;
+  handle.resume();
+
+  // Rethrowing here would take the exception out through the worker loop.
+  if(handle.done())
+  {
+    if(promise.exception)
+      task.setException(promise.exception);
+    return RunAgain::No;
+  }
+
+  // The task is still running so this is held until it suspends.
+  if(promise.resumeDelayMS>=0)
+    promise.resumer->resume(promise.resumeDelayMS);
+
+  return RunAgain::Suspend;
+}
+
+//##################################################################################################
+void TaskCoroutine::destroy()
+{
+  if(!handle)
+    return;
+
+  // Stop anything that the coroutine was waiting on from resuming the task once it has gone.
+  if(auto& resumer = handle.promise().resumer; resumer)
+    resumer->detach();
+
+  handle.destroy();
+  handle = nullptr;
+}
+
+}
+
+#endif
@@ -0,0 +1,155 @@
+#include "tp_task_queue/Parallel.h"
+#include "tp_task_queue/TaskQueue.h"
+
+#include <atomic>
+#include <exception>
+
+namespace tp_task_queue
+{
+
+namespace
+{
+//##################################################################################################
+//! The state shared by the caller and the helpers of a parallelFor.
+/*!
+Helpers register under the mutex before they claim anything and the caller clears f under the same
+lock once it is done, so helpers that start after the caller has returned never see f. The mutex
+also orders everything a helper did against the caller returning.
+*/
+struct ParallelFor_lt
+{
+  TP_NONCOPYABLE(ParallelFor_lt);
+
+  std::atomic<size_t> next;
+  const size_t end;
+  const size_t grain;
+  const size_t participants;
+  //! Guarded by mutex, nullptr once the caller is done.
+  const std::function<void(size_t, size_t)>* f;
+
+  size_t activeHelpers{0}; //!< Guarded by mutex.
+  TPMutex mutex{TPM};
+  TPWaitCondition waitCondition;
+  std::exception_ptr exception;
+
+  //################################################################################################
+  ParallelFor_lt(size_t begin_,
+                 size_t end_,
+                 size_t grain_,
+                 size_t participants_,
+                 const std::function<void(size_t, size_t)>& f_):
+    next(begin_),
+    end(end_),
+    grain(grain_),
+    participants(participants_),
+    f(&f_)
+  {
+
+  }
+
+  //################################################################################################
+  //! Claim the next chunk, chunks are a share of what is left so they shrink towards the end.
+  bool claim(size_t& chunkBegin, size_t& chunkEnd)
+  {
+    size_t start = next.load(std::memory_order_acquire);
+    for(;;)
+    {
+      if(start>=end)
+        return false;
+
+      size_t remaining = end - start;
+      size_t chunk = tpMin(remaining, tpMax(grain, remaining/(2*participants)));
+      if(next.compare_exchange_weak(start,
+                                    start+chunk,
+                                    std::memory_order_acq_rel,
+                                    std::memory_order_acquire))
+      {
+        chunkBegin = start;
+        chunkEnd = start+chunk;
+        return true;
+      }
+    }
+  }
+
+  //################################################################################################
+  void work(const std::function<void(size_t, size_t)>& function)
+  {
+    try
+    {
+      size_t chunkBegin=0;
+      size_t chunkEnd=0;
+      while(claim(chunkBegin, chunkEnd))
+        function(chunkBegin, chunkEnd);
+    }
+    catch(...)
+    {
+      next = end;
+      TP_MUTEX_LOCKER(mutex);
+      if(!exception)
+        exception = std::current_exception();
+    }
+  }
+
+  //################################################################################################
+  //! Run from a worker thread of the queue.
+  void help()
+  {
+    const std::function<void(size_t, size_t)>* function;
+    {
+      TP_MUTEX_LOCKER(mutex);
+      function = f;
+      if(!function)
+        return;
+      activeHelpers++;
+    }
+
+    work(*function);
+
+    TP_MUTEX_LOCKER(mutex);
+    activeHelpers--;
+    if(activeHelpers==0)
+      waitCondition.wakeAll();
+  }
+};
+}
+
+//##################################################################################################
+void parallelFor(TaskQueue& taskQueue,
+                 size_t begin,
+                 size_t end,
+                 size_t grain,
+                 const std::function<void(size_t, size_t)>& f)
+{
+  if(begin>=end)
+    return;
+
+  grain = tpMax(size_t(1), grain);
+  size_t chunks = (end - begin + grain - 1) / grain;
+  size_t helpers = tpMin(taskQueue.numberOfTaskThreads(), chunks-1);
+
+  if(helpers==0)
+  {
+    f(begin, end);
+    return;
+  }
+
+  auto state = std::make_shared<ParallelFor_lt>(begin, end, grain, helpers+1, f);
+  for(size_t i=0; i<helpers; i++)
+    taskQueue.post([state]{state->help();});
+
+  state->work(f);
+
+  std::exception_ptr exception;
+  {
+    TPMutexLocker lock(state->mutex);
+    state->f = nullptr;
+    while(state->activeHelpers>0)
+      state->waitCondition.wait(TPMc lock);
+    exception = state->exception;
+  }
+
+  if(exception)
+    std::rethrow_exception(exception);
+}
+
+}
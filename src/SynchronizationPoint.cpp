@@ -1,8 +1,10 @@
 #include "tp_task_queue/SynchronizationPoint.h"
 #include "tp_task_queue/Task.h"
+#include "tp_task_queue/TaskQueue.h"
 
 #include "tp_utils/MutexUtils.h"
-#include "tp_utils/DebugUtils.h"
+
+#include <atomic>
 
 namespace tp_task_queue
 {
@@ -13,10 +15,28 @@ struct SynchronizationPoint::Private
   TP_REF_COUNT_OBJECTS("tp_task_queue::SynchronizationPoint::Private");
   TP_NONCOPYABLE(Private);
 
-  std::vector<Task*> tasks;
   TPMutex mutex{TPM};
   TPWaitCondition waitCondition;
 
+  //! Head of the intrusive list of tasks, linked through Task::synchronizationPointLinks.
+  Task* head{nullptr};
+
+  //! The number of tasks in the list, this can be read without the mutex.
+  std::atomic<size_t> count{0};
+
+  //! Waiters are counted so that removing a task only wakes threads that can make progress.
+  size_t joinWaiters{0};
+  size_t throttleWaiters{0};
+  size_t throttleLimit{0};
+
+  //! The number of taskRemoved callbacks in progress, join waits for these to return.
+  size_t callbacksRunning{0};
+
+  //! Worker threads that are waiting in their queue for work to help with, and a counter that is
+  //! bumped as tasks are removed so that they can tell that they need to check again.
+  size_t helpWaiters{0};
+  std::atomic<uint64_t> removals{0};
+
   std::function<void()> taskRemoved;
 
   //################################################################################################
@@ -25,6 +45,48 @@ struct SynchronizationPoint::Private
   {
 
   }
+
+  //################################################################################################
+  //! Wait for a task to be removed, or run a pending task if called from a worker thread.
+  /*!
+  Call with mutex locked. A worker that blocks here would take a thread from the pool that the
+  tasks may need, so instead it runs tasks from its own queue.
+  */
+  void waitOrHelp(TPMutexLocker& lock, const SynchronizationPoint* synchronizationPoint)
+  {
+    TaskQueue* taskQueue = head?head->taskQueue():nullptr;
+    if(!taskQueue || !taskQueue->isWorkerThread())
+    {
+      waitCondition.wait(TPMc lock);
+      return;
+    }
+
+    // The helper waits in the queue so that it is woken by new work as well as by removeTask.
+    uint64_t seen = removals;
+    helpWaiters++;
+    {
+      TP_MUTEX_UNLOCKER(lock);
+      if(!taskQueue->runPendingTask(synchronizationPoint))
+        taskQueue->waitForPendingTask([&]{return removals!=seen;});
+    }
+    helpWaiters--;
+  }
+
+  //################################################################################################
+  //! Wake waiters that can make progress, call with mutex locked.
+  /*!
+  \return True if helpers need to be woken through their queue once the mutex is released.
+  */
+  bool wakeWaiters()
+  {
+    size_t n = count;
+    if(!((n==0 && callbacksRunning==0 && joinWaiters>0) || (throttleWaiters>0 && n<throttleLimit)))
+      return false;
+
+    removals++;
+    waitCondition.wakeAll();
+    return helpWaiters>0;
+  }
 };
 
 //##################################################################################################
@@ -45,8 +107,12 @@ SynchronizationPoint::~SynchronizationPoint()
 void SynchronizationPoint::join()
 {
   TPMutexLocker lock(d->mutex);
-  while(!d->tasks.empty())
-    d->waitCondition.wait(TPMc lock);
+  while(d->count>0 || d->callbacksRunning>0)
+  {
+    d->joinWaiters++;
+    d->waitOrHelp(lock, this);
+    d->joinWaiters--;
+  }
 }
 
 //##################################################################################################
@@ -54,35 +120,78 @@ void SynchronizationPoint::addTask(Task* task, size_t maxActive)
 {
   task->setSynchronizationPoint(this);
   TPMutexLocker lock(d->mutex);
-  while(d->tasks.size()>=maxActive)
-    d->waitCondition.wait(TPMc lock);
-  d->tasks.push_back(task);
+  while(d->count>=maxActive)
+  {
+    d->throttleWaiters++;
+    d->throttleLimit = tpMax(d->throttleLimit, maxActive);
+    d->waitOrHelp(lock, this);
+    if(--d->throttleWaiters==0)
+      d->throttleLimit = 0;
+  }
+
+  auto& links = task->synchronizationPointLinks();
+  links.previous = nullptr;
+  links.next = d->head;
+  if(d->head)
+    d->head->synchronizationPointLinks().previous = task;
+  d->head = task;
+  d->count++;
 }
 
 //##################################################################################################
 void SynchronizationPoint::cancelTasks()
 {
   TP_MUTEX_LOCKER(d->mutex);
-  for(auto task : d->tasks)
+  for(Task* task=d->head; task; task=task->synchronizationPointLinks().next)
     task->cancelTask();
 }
 
 //##################################################################################################
 size_t SynchronizationPoint::activeTasks()
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  return d->tasks.size();
+  return d->count;
 }
 
 //##################################################################################################
 void SynchronizationPoint::removeTask(Task* task)
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  tpRemoveOne(d->tasks, task);
-  d->waitCondition.wakeAll();
+  TaskQueue* taskQueue = task->taskQueue();
+  bool wakeHelpers;
+  bool callback;
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    auto& links = task->synchronizationPointLinks();
+    if(links.previous)
+      links.previous->synchronizationPointLinks().next = links.next;
+    else
+      d->head = links.next;
+    if(links.next)
+      links.next->synchronizationPointLinks().previous = links.previous;
+
+    d->count--;
+    callback = d->taskRemoved!=nullptr;
+    if(callback)
+      d->callbacksRunning++;
+    wakeHelpers = d->wakeWaiters();
+  }
+
+  // Without a callback a woken join may delete this as soon as the mutex is released.
+  if(wakeHelpers && taskQueue)
+    taskQueue->wakeHelpers();
+
+  if(!callback)
+    return;
+
+  d->taskRemoved();
+
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    d->callbacksRunning--;
+    wakeHelpers = d->wakeWaiters();
+  }
 
-  if(d->taskRemoved)
-    d->taskRemoved();
+  if(wakeHelpers && taskQueue)
+    taskQueue->wakeHelpers();
 }
 
 }
@@ -1,67 +1,167 @@
 #include "tp_task_queue/Task.h"
 #include "tp_task_queue/SynchronizationPoint.h"
+#include "tp_task_queue/TaskGraph.h"
+#include "tp_task_queue/Future.h"
 
 #include "tp_utils/MutexUtils.h"
+#include "tp_utils/DebugUtils.h"
 
 #include <atomic>
+#include <memory>
+#include <new>
 
 namespace tp_task_queue
 {
 
+namespace
+{
+//! Written state is kept on its own cache line so that it does not slow down readers of the rest.
+constexpr size_t cacheLineSize_lt=64;
+
+//##################################################################################################
+//! The block and Private storage returned by the last Task::operator new on this thread.
+thread_local void* inlineBlock_lt{nullptr};
+thread_local void* inlinePrivate_lt{nullptr};
+
+//! The block of task IDs that this thread is handing out, see Task::Private::generateTaskID.
+constexpr int64_t taskIDBlockSize_lt=1024;
+thread_local int64_t nextTaskID_lt{0};
+thread_local int64_t endTaskID_lt{0};
+}
+
 //##################################################################################################
 struct Task::Private
 {
   TP_REF_COUNT_OBJECTS("tp_task_queue::Task::Private");
   TP_NONCOPYABLE(Private);
 
+  // Read by the scheduler and admin thread on every pass, these rarely change once queued.
   int64_t taskID{generateTaskID()};
+  std::atomic<int64_t> timeout;
+  bool pauseable;
+  std::atomic_bool finish{false};
+  std::atomic_bool paused{false};
+  std::atomic<TaskPriority> priority;
+  std::atomic<TimerMode> timerMode{TimerMode::FixedDelay};
+  std::atomic_int numaNode{-1};
+
   std::string taskName;
-  TaskCallback performTask;
-  int64_t timeout;
+  TaskFunction performTask;
   std::string timeoutMessage;
+  std::string concurrencyGroup;
 
+  //! Only one of these is set, see Task::setTaskStatusChangedCallback.
   std::function<void(const TaskStatus&)> statusChangedCallback;
+  std::function<void(const Task&)> taskStatusChangedCallback;
 
-  SynchronizationPoint* synchronizationPoint{nullptr};
+  std::atomic<SynchronizationPoint*> synchronizationPoint{nullptr};
+  SynchronizationPointLinks synchronizationPointLinks; //!< Guarded by the synchronization point.
 
-  TaskQueue* taskQueue{nullptr};
+  TaskGraph* taskGraph{nullptr};
+  size_t taskGraphNode{0};
 
+  //! Created by finished and kept by the task until it is deleted.
+  std::unique_ptr<Promise<void>> finishedPromise;
+  std::exception_ptr exception; //!< See setException.
+
+  std::atomic<TaskQueue*> taskQueue{nullptr};
+
+  //! Updated by the task as it runs, the message is only copied when it changes.
+  alignas(cacheLineSize_lt) std::atomic_int progress{-1};
+  std::atomic<int64_t> messageRevision{0}; //!< Bumped after each change to message.
   TPMutex taskStatusMutex{TPM};
-  TaskStatus taskStatus;
+  std::string message;   //!< Guarded by taskStatusMutex.
+  bool complete{false};  //!< Guarded by taskStatusMutex.
 
-  bool pauseable;
-  std::atomic_bool finish{false};
-  std::atomic_bool paused{false};
+  //! True if this was constructed in the same block as the Task, see Task::operator new.
+  bool inlineAllocation{false};
 
   //################################################################################################
   Private(std::string taskName_,
-          TaskCallback performTask_,
+          TaskFunction performTask_,
           int64_t timeout_,
           std::string timeoutMessage_,
-          bool pauseable_):
+          bool pauseable_,
+          TaskPriority priority_):
+    timeout(timeout_),
+    pauseable(pauseable_),
+    priority(priority_),
     taskName(std::move(taskName_)),
     performTask(std::move(performTask_)),
-    timeout(timeout_),
-    timeoutMessage(std::move(timeoutMessage_)),
-    pauseable(pauseable_)
+    timeoutMessage(std::move(timeoutMessage_))
+  {
+
+  }
+
+  //################################################################################################
+  //! Set the message and bump the revision if it has changed, call with taskStatusMutex locked.
+  void setMessage(const std::string& newMessage)
+  {
+    if(message == newMessage)
+      return;
+
+    message = newMessage;
+    messageRevision.fetch_add(1, std::memory_order_release);
+  }
+
+  //################################################################################################
+  void notifyStatusChanged(const Task& task)
   {
+    if(taskStatusChangedCallback)
+      taskStatusChangedCallback(task);
+    else if(statusChangedCallback)
+      statusChangedCallback(task.taskStatus());
+  }
+
+  //################################################################################################
+  //! Construct in the block allocated by Task::operator new if task was allocated by it.
+  template<typename... Args>
+  static Private* create(Task* task, Args&&... args)
+  {
+    void* inlinePrivate = inlinePrivate_lt;
+    bool useInline = (inlineBlock_lt == task);
+    inlineBlock_lt = nullptr;
+    inlinePrivate_lt = nullptr;
+
+    if(!useInline)
+      return new Private(std::forward<Args>(args)...);
 
+    auto d = new (inlinePrivate) Private(std::forward<Args>(args)...);
+    d->inlineAllocation = true;
+    return d;
   }
 
   //################################################################################################
+  //! Each thread takes a block of IDs at a time so that threads creating tasks don't contend.
+  /*!
+  IDs are unique and increase on each thread but are not ordered between threads.
+  */
   int64_t generateTaskID()
   {
-    static TPMutex mutex{TPM};
-    static int64_t count{0};
-    TP_MUTEX_LOCKER(mutex);
-    count++;
-    return count;
+    if(nextTaskID_lt == endTaskID_lt)
+    {
+      static std::atomic<int64_t> count{1};
+      nextTaskID_lt = count.fetch_add(taskIDBlockSize_lt, std::memory_order_relaxed);
+      endTaskID_lt = nextTaskID_lt + taskIDBlockSize_lt;
+    }
+    return nextTaskID_lt++;
   }
 };
 
 //##################################################################################################
-Task::Task(const std::string& taskName, const TaskCallback& performTask, int64_t timeout, const std::string& timeoutMessage, bool pauseable):
-  d(new Private(taskName, performTask, timeout, timeoutMessage, pauseable))
+Task::Task(const std::string& taskName,
+           TaskFunction performTask,
+           int64_t timeout,
+           const std::string& timeoutMessage,
+           bool pauseable,
+           TaskPriority priority):
+  d(Private::create(this,
+                    taskName,
+                    std::move(performTask),
+                    timeout,
+                    timeoutMessage,
+                    pauseable,
+                    priority))
 {
 
 }
@@ -69,9 +169,90 @@ Task::Task(const std::string& taskName, const TaskCallback& performTask, int64_t
 //##################################################################################################
 Task::~Task()
 {
-  if(d->synchronizationPoint)
-    d->synchronizationPoint->removeTask(this);
-  delete d;
+  // Captures are released before anyone waiting on the task is told that it has gone.
+  d->performTask = nullptr;
+
+  if(SynchronizationPoint* synchronizationPoint = d->synchronizationPoint; synchronizationPoint)
+    synchronizationPoint->removeTask(this);
+
+  if(d->taskGraph)
+    d->taskGraph->taskFinished(d->taskGraphNode, d->finish);
+
+  if(d->finishedPromise)
+  {
+    if(d->exception)
+      d->finishedPromise->setException(d->exception);
+    else
+      d->finishedPromise->setValue();
+  }
+  else if(d->exception)
+    tpWarning() << "Task " << d->taskName << " failed with an exception that nothing waited for.";
+
+  if(d->inlineAllocation)
+    d->~Private();
+  else
+    delete d;
+}
+
+//##################################################################################################
+void* Task::operator new(size_t size)
+{
+  constexpr size_t alignment = alignof(Private);
+  size_t offset = (size + alignment - 1) / alignment * alignment;
+  auto block = static_cast<char*>(::operator new(offset + sizeof(Private),
+                                                 std::align_val_t(alignment)));
+  inlineBlock_lt = block;
+  inlinePrivate_lt = block + offset;
+  return block;
+}
+
+//##################################################################################################
+void* Task::operator new(size_t size, const std::nothrow_t&) noexcept
+{
+  // The block has the same layout as operator new as it is freed by the same operator delete.
+  constexpr size_t alignment = alignof(Private);
+  size_t offset = (size + alignment - 1) / alignment * alignment;
+  auto block = static_cast<char*>(::operator new(offset + sizeof(Private),
+                                                 std::align_val_t(alignment),
+                                                 std::nothrow));
+  if(block)
+  {
+    inlineBlock_lt = block;
+    inlinePrivate_lt = block + offset;
+  }
+  return block;
+}
+
+//##################################################################################################
+void Task::operator delete(void* ptr)
+{
+  // This is called without the constructor having run if evaluating an argument of new Task throws,
+  // the block must not be taken for a Task that is later constructed at the same address.
+  if(ptr == inlineBlock_lt)
+  {
+    inlineBlock_lt = nullptr;
+    inlinePrivate_lt = nullptr;
+  }
+
+  ::operator delete(ptr, std::align_val_t(alignof(Private)));
+}
+
+//##################################################################################################
+void Task::operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+  Task::operator delete(ptr);
+}
+
+//##################################################################################################
+void* Task::operator new(size_t size, void* place) noexcept
+{
+  return ::operator new(size, place);
+}
+
+//##################################################################################################
+void Task::operator delete(void* ptr, void* place) noexcept
+{
+  ::operator delete(ptr, place);
 }
 
 //##################################################################################################
@@ -98,6 +279,18 @@ void Task::setTimeoutMS(int64_t timeout)
   d->timeout = timeout;
 }
 
+//##################################################################################################
+TimerMode Task::timerMode() const
+{
+  return d->timerMode;
+}
+
+//##################################################################################################
+void Task::setTimerMode(TimerMode timerMode)
+{
+  d->timerMode = timerMode;
+}
+
 //##################################################################################################
 const std::string& Task::timeoutMessage() const
 {
@@ -121,8 +314,45 @@ void Task::setPaused(bool paused)
 {
   d->paused = paused;
 
-  if(d->statusChangedCallback)
-    d->statusChangedCallback(taskStatus());
+  d->notifyStatusChanged(*this);
+}
+
+//##################################################################################################
+TaskPriority Task::priority() const
+{
+  return d->priority;
+}
+
+//##################################################################################################
+void Task::setPriority(TaskPriority priority)
+{
+  d->priority = priority;
+
+  d->notifyStatusChanged(*this);
+}
+
+//##################################################################################################
+int Task::numaNode() const
+{
+  return d->numaNode;
+}
+
+//##################################################################################################
+void Task::setNUMANode(int numaNode)
+{
+  d->numaNode = numaNode;
+}
+
+//##################################################################################################
+const std::string& Task::concurrencyGroup() const
+{
+  return d->concurrencyGroup;
+}
+
+//##################################################################################################
+void Task::setConcurrencyGroup(const std::string& concurrencyGroup)
+{
+  d->concurrencyGroup = concurrencyGroup;
 }
 
 //##################################################################################################
@@ -146,47 +376,84 @@ RunAgain Task::performTask()
 //##################################################################################################
 TaskStatus Task::taskStatus()const
 {
+  TaskStatus taskStatus;
+  int64_t messageRevision=-1;
+  copyTaskStatus(taskStatus, messageRevision);
+  return taskStatus;
+}
+
+//##################################################################################################
+void Task::copyTaskStatus(TaskStatus& taskStatus, int64_t& messageRevision)const
+{
+  if(taskStatus.taskID != d->taskID)
+  {
+    taskStatus.taskID = d->taskID;
+    taskStatus.taskName = d->taskName;
+    messageRevision = -1;
+  }
+
+  taskStatus.progress = d->progress.load(std::memory_order_relaxed);
+  taskStatus.pauseable = d->pauseable;
+  taskStatus.paused = d->paused;
+  taskStatus.priority = d->priority;
+
+  if(d->messageRevision.load(std::memory_order_acquire) == messageRevision)
+    return;
+
   TP_MUTEX_LOCKER(d->taskStatusMutex);
-  d->taskStatus.taskID = d->taskID;
-  d->taskStatus.taskName = d->taskName;
-  d->taskStatus.pauseable = d->pauseable;
-  d->taskStatus.paused = d->paused;
-  return d->taskStatus;
+  taskStatus.message = d->message;
+  taskStatus.complete = d->complete;
+  messageRevision = d->messageRevision.load(std::memory_order_relaxed);
 }
 
 //##################################################################################################
 void Task::updateTaskStatus(const TaskStatus& taskStatus)
 {
-  d->taskStatusMutex.lock(TPM);
-  d->taskStatus = taskStatus;
-  d->taskStatus.pauseable = d->pauseable;
-  d->taskStatus.paused = d->paused;
-  auto ts = d->taskStatus;
-  d->taskStatusMutex.unlock(TPM);
+  d->progress.store(taskStatus.progress, std::memory_order_relaxed);
+  {
+    TP_MUTEX_LOCKER(d->taskStatusMutex);
+    if(d->complete != taskStatus.complete)
+    {
+      d->complete = taskStatus.complete;
+      d->messageRevision.fetch_add(1, std::memory_order_release);
+    }
+    d->setMessage(taskStatus.message);
+  }
 
-  if(d->statusChangedCallback)
-    d->statusChangedCallback(ts);
+  d->notifyStatusChanged(*this);
 }
 
 //##################################################################################################
 void Task::updateTaskStatus(const std::string& message, int progress)
 {
-  d->taskStatusMutex.lock(TPM);
-  d->taskStatus.message = message;
-  d->taskStatus.progress = progress;
-  d->taskStatus.pauseable = d->pauseable;
-  d->taskStatus.paused = d->paused;
-  auto ts = d->taskStatus;
-  d->taskStatusMutex.unlock(TPM);
+  d->progress.store(progress, std::memory_order_relaxed);
+  {
+    TP_MUTEX_LOCKER(d->taskStatusMutex);
+    d->setMessage(message);
+  }
+
+  d->notifyStatusChanged(*this);
+}
 
-  if(d->statusChangedCallback)
-    d->statusChangedCallback(ts);
+//##################################################################################################
+void Task::updateTaskProgress(int progress)
+{
+  d->progress.store(progress, std::memory_order_relaxed);
+  d->notifyStatusChanged(*this);
 }
 
 //##################################################################################################
 void Task::setStatusChangedCallback(std::function<void(const TaskStatus&)> statusChangedCallback)
 {
   d->statusChangedCallback = std::move(statusChangedCallback);
+  d->taskStatusChangedCallback = nullptr;
+}
+
+//##################################################################################################
+void Task::setTaskStatusChangedCallback(std::function<void(const Task&)> taskStatusChangedCallback)
+{
+  d->taskStatusChangedCallback = std::move(taskStatusChangedCallback);
+  d->statusChangedCallback = nullptr;
 }
 
 //##################################################################################################
@@ -201,10 +468,43 @@ TaskQueue* Task::taskQueue()const
   return d->taskQueue;
 }
 
+//##################################################################################################
+SynchronizationPoint* Task::synchronizationPoint() const
+{
+  return d->synchronizationPoint;
+}
+
+//##################################################################################################
+Future<void> Task::finished()
+{
+  if(!d->finishedPromise)
+    d->finishedPromise = std::make_unique<Promise<void>>();
+  return d->finishedPromise->future();
+}
+
+//##################################################################################################
+void Task::setException(std::exception_ptr exception)
+{
+  d->exception = std::move(exception);
+}
+
 //##################################################################################################
 void Task::setSynchronizationPoint(SynchronizationPoint* synchronizationPoint)
 {
   d->synchronizationPoint = synchronizationPoint;
 }
 
+//##################################################################################################
+SynchronizationPointLinks& Task::synchronizationPointLinks()
+{
+  return d->synchronizationPointLinks;
+}
+
+//##################################################################################################
+void Task::setTaskGraph(TaskGraph* taskGraph, size_t node)
+{
+  d->taskGraph = taskGraph;
+  d->taskGraphNode = node;
+}
+
 }
@@ -0,0 +1,311 @@
+#include "tp_task_queue/TaskGraph.h"
+#include "tp_task_queue/TaskQueue.h"
+#include "tp_task_queue/Task.h"
+
+#include "tp_utils/MutexUtils.h"
+#include "tp_utils/DebugUtils.h"
+
+#include <atomic>
+#include <deque>
+
+namespace tp_task_queue
+{
+
+namespace
+{
+//##################################################################################################
+struct Node_lt
+{
+  TP_NONCOPYABLE(Node_lt);
+  Node_lt()=default;
+
+  //! Owned by the graph until the node is started, then cleared by taskFinished under the mutex.
+  Task* task{nullptr};
+  std::vector<size_t> successors;
+  size_t predecessors{0};
+
+  //! The number of predecessors that have not finished, the thread that takes this to zero owns the
+  //! node and either starts it or skips it.
+  std::atomic<size_t> remaining{0};
+
+  //! Set if any predecessor was cancelled or skipped.
+  std::atomic_bool skip{false};
+
+  bool started{false};
+};
+
+//##################################################################################################
+//! The lists of the processNodes call that is running on this thread, see processNodes.
+struct WorkList_lt
+{
+  const void* owner{nullptr};
+  std::vector<size_t>* ready{nullptr};
+  std::vector<size_t>* skipped{nullptr};
+  size_t* finished{nullptr};
+};
+
+thread_local WorkList_lt workList_lt;
+}
+
+//##################################################################################################
+struct TaskGraph::Private
+{
+  TP_REF_COUNT_OBJECTS("tp_task_queue::TaskGraph::Private");
+  TP_NONCOPYABLE(Private);
+
+  TaskQueue* taskQueue;
+
+  TPMutex mutex{TPM};
+  TPWaitCondition waitCondition;
+  std::deque<Node_lt> nodes;
+  size_t outstanding{0};
+  bool running{false};
+  std::atomic_bool cancelled{false};
+
+  //################################################################################################
+  Private(TaskQueue* taskQueue_):
+    taskQueue(taskQueue_)
+  {
+
+  }
+
+  //################################################################################################
+  //! Take the task of a node that will not be run, call with the mutex locked.
+  /*!
+  The caller deletes the task once the mutex is released, as ~Task may call back into the graph or
+  the queue.
+  */
+  Task* takeTask(Node_lt& node)
+  {
+    Task* task = node.task;
+    node.task = nullptr;
+    task->setTaskGraph(nullptr, 0);
+    return task;
+  }
+
+  //################################################################################################
+  //! Release the successors of a node, call with the mutex unlocked.
+  /*!
+  \param ready Successors that can now be started.
+  \param skipped Successors that will not be run.
+  */
+  void releaseSuccessors(size_t index,
+                         bool skip,
+                         std::vector<size_t>& ready,
+                         std::vector<size_t>& skipped)
+  {
+    for(size_t successor : nodes[index].successors)
+    {
+      Node_lt& node = nodes[successor];
+      if(skip)
+        node.skip = true;
+
+      if(node.remaining.fetch_sub(1, std::memory_order_acq_rel)==1)
+      {
+        if(node.skip || cancelled)
+          skipped.push_back(successor);
+        else
+          ready.push_back(successor);
+      }
+    }
+  }
+
+  //################################################################################################
+  //! Skip nodes and their successors, then start the ready nodes.
+  /*!
+  Call with the mutex unlocked.
+  \param finished The number of nodes that have already finished, for the outstanding count.
+  */
+  void processNodes(std::vector<size_t>& ready, std::vector<size_t>& skipped, size_t finished)
+  {
+    // A queue that has been shut down deletes tasks as they are added, which finishes their nodes
+    // from inside addTasks. Those go onto the lists of the call that added them rather than
+    // recursing, so that long chains don't overflow the stack.
+    if(workList_lt.owner == this)
+    {
+      workList_lt.ready->insert(workList_lt.ready->end(), ready.begin(), ready.end());
+      workList_lt.skipped->insert(workList_lt.skipped->end(), skipped.begin(), skipped.end());
+      *workList_lt.finished += finished;
+      return;
+    }
+
+    WorkList_lt outer = workList_lt;
+    workList_lt = {this, &ready, &skipped, &finished};
+
+    std::vector<Task*> tasks;
+    do
+    {
+      // Skipped nodes are processed with a work list so that long chains don't recurse.
+      while(!skipped.empty())
+      {
+        size_t index = skipped.back();
+        skipped.pop_back();
+        releaseSuccessors(index, true, ready, skipped);
+        Task* task;
+        {
+          TP_MUTEX_LOCKER(mutex);
+          task = takeTask(nodes[index]);
+        }
+        delete task;
+        finished++;
+      }
+
+      tasks.clear();
+      tasks.reserve(ready.size());
+      {
+        TP_MUTEX_LOCKER(mutex);
+        for(size_t index : ready)
+        {
+          nodes[index].started = true;
+          tasks.push_back(nodes[index].task);
+        }
+        ready.clear();
+
+        outstanding -= finished;
+        finished = 0;
+        if(outstanding==0)
+          waitCondition.wakeAll();
+      }
+
+      // Once added a task can finish at any time so it is only touched through the queue from
+      // here. After outstanding reaches zero the graph may be deleted, there is nothing to add
+      // then and the lists stay empty.
+      if(!tasks.empty())
+        taskQueue->addTasks(tasks);
+    }
+    while(!ready.empty() || !skipped.empty() || finished);
+
+    workList_lt = outer;
+  }
+};
+
+//##################################################################################################
+TaskGraph::TaskGraph(TaskQueue* taskQueue):
+  d(new Private(taskQueue))
+{
+
+}
+
+//##################################################################################################
+TaskGraph::~TaskGraph()
+{
+  join();
+
+  std::vector<Task*> tasks;
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    for(auto& node : d->nodes)
+      if(node.task)
+        tasks.push_back(d->takeTask(node));
+  }
+
+  for(Task* task : tasks)
+    delete task;
+
+  delete d;
+}
+
+//##################################################################################################
+size_t TaskGraph::addNode(Task* task, const std::vector<size_t>& predecessors)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  size_t index = d->nodes.size();
+
+  if(d->running)
+  {
+    tpWarning() << "TaskGraph::addNode called after run, the task will not be run.";
+    delete task;
+    return index;
+  }
+
+  Node_lt& node = d->nodes.emplace_back();
+  node.task = task;
+  task->setTaskGraph(this, index);
+
+  for(size_t predecessor : predecessors)
+  {
+    if(predecessor>=index)
+    {
+      tpWarning() << "TaskGraph::addNode predecessor " << predecessor << " has not been added yet.";
+      continue;
+    }
+
+    d->nodes[predecessor].successors.push_back(index);
+    node.predecessors++;
+  }
+
+  return index;
+}
+
+//##################################################################################################
+void TaskGraph::run()
+{
+  std::vector<size_t> ready;
+  std::vector<size_t> skipped;
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    if(d->running)
+      return;
+
+    d->running = true;
+    d->outstanding = d->nodes.size();
+
+    // All counters are set before anything is started as nodes can finish as soon as they are.
+    for(size_t i=0; i<d->nodes.size(); i++)
+    {
+      Node_lt& node = d->nodes[i];
+      node.remaining.store(node.predecessors, std::memory_order_relaxed);
+      if(node.predecessors==0)
+        (d->cancelled?skipped:ready).push_back(i);
+    }
+  }
+
+  d->processNodes(ready, skipped, 0);
+}
+
+//##################################################################################################
+void TaskGraph::join()
+{
+  TPMutexLocker lock(d->mutex);
+  while(d->outstanding>0)
+    d->waitCondition.wait(TPMc lock);
+}
+
+//##################################################################################################
+void TaskGraph::cancel()
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->cancelled = true;
+  for(auto& node : d->nodes)
+    if(node.started && node.task)
+      node.task->cancelTask();
+}
+
+//##################################################################################################
+bool TaskGraph::cancelled() const
+{
+  return d->cancelled;
+}
+
+//##################################################################################################
+size_t TaskGraph::numberOfNodes() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->nodes.size();
+}
+
+//##################################################################################################
+void TaskGraph::taskFinished(size_t node, bool cancelled)
+{
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    d->nodes[node].task = nullptr;
+  }
+
+  std::vector<size_t> ready;
+  std::vector<size_t> skipped;
+  d->releaseSuccessors(node, cancelled || d->cancelled, ready, skipped);
+  d->processNodes(ready, skipped, 1);
+}
+
+}
@@ -1,18 +1,56 @@
 #include "tp_task_queue/TaskQueue.h"
+#include "tp_task_queue/SynchronizationPoint.h"
 
 #include "tp_utils/MutexUtils.h"
+#include "tp_utils/DebugUtils.h"
 #include "tp_utils/TimeUtils.h"
 
 #include "lib_platform/SetThreadName.h"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <sstream>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace tp_task_queue
 {
 
 namespace
 {
+//! The number of removals remembered for TaskQueue::taskStatusChangesSince.
+constexpr size_t maxRemovedTaskStatuses_lt=4096;
+
+struct TaskDetails_lt;
+
+//##################################################################################################
+//! A named group of tasks with a limit on how many run at once, see TaskQueue::setConcurrencyLimit.
+struct ConcurrencyGroup_lt
+{
+  size_t maxActive{0};
+  size_t active{0};
+
+  //! Ready tasks that were set aside because the group was full, in the order that they arrived.
+  std::deque<TaskDetails_lt*> waiting;
+
+  //################################################################################################
+  bool full() const
+  {
+    return maxActive>0 && active>=maxActive;
+  }
+};
+
 //##################################################################################################
 struct TaskDetails_lt
 {
@@ -20,8 +58,41 @@ struct TaskDetails_lt
   TP_NONCOPYABLE(TaskDetails_lt);
 
   Task* task{nullptr};
-  int64_t nextRun{0};
-  bool active{false};
+  //! When the task is due, in us on the scheduler clock, see currentTimeUS_lt.
+  int64_t nextRunUS{0};
+  std::atomic_bool active{false};
+  //! What the waiting message shows: -1 nothing, -2 paused, otherwise the seconds until it runs.
+  int64_t waitingMessage{-1};
+
+  //! The concurrency group of the task, if any, and whether it holds one of the group's slots.
+  ConcurrencyGroup_lt* group{nullptr};
+  bool groupSlot{false};
+
+  //! Set by resumeTask while the task is running, in us, -1 if there is no resume waiting.
+  int64_t resumeAtUS{-1};
+
+  //! Set while the task is in pausedTasks, read without the mutex by the status changed callback.
+  std::atomic_bool parked{false};
+
+  //! Set once the task has returned RunAgain::Suspend, it is part way through and can't be
+  //! handed back by TaskQueue::shutdown.
+  bool suspended{false};
+
+  //! When the task became ready to run in ns, zero unless statistics are enabled.
+  int64_t readySinceNS{0};
+
+  //! Index of this task in taskStatuses, guarded by taskStatusMutex.
+  size_t statusIndex{SIZE_MAX};
+
+  //! The revision of the task message held in taskStatuses, see Task::copyTaskStatus.
+  int64_t messageRevision{-1};
+
+  //! Links in the list of statuses in revision order, guarded by taskStatusMutex.
+  TaskDetails_lt* olderStatus{nullptr};
+  TaskDetails_lt* newerStatus{nullptr};
+
+  //! Used in place of task for closures added with TaskQueue::post.
+  InplaceFunction<void()> closure;
 
   TaskDetails_lt()=default;
 
@@ -29,324 +100,3072 @@ struct TaskDetails_lt
   {
     delete task;
   }
-};
 
-}
+  //################################################################################################
+  bool paused() const
+  {
+    return task && task->paused();
+  }
 
-//##################################################################################################
-struct TaskQueue::Private
-{
-  TP_REF_COUNT_OBJECTS("tp_task_queue::TaskQueue::Private");
-  TP_NONCOPYABLE(Private);
+  //################################################################################################
+  //! Posted closures run at normal priority.
+  TaskPriority priority() const
+  {
+    return task?task->priority():TaskPriority::Normal;
+  }
 
-  std::string threadName;
+  //################################################################################################
+  //! Call with the mutex unlocked, a posted closure is released here so that its captures are
+  //! destroyed outside of the lock.
+  RunAgain run()
+  {
+    if(task)
+      return task->performTask();
 
-  TPMutex mutex{TPM};
-  TPWaitCondition waitCondition;
-  TPWaitCondition updateWaitingMessagesWaitCondition;
-  TPWaitCondition threadFinishedWaitCondition;
-  std::vector<TaskDetails_lt*> tasks;
+    closure();
+    closure = nullptr;
+    return RunAgain::No;
+  }
+};
 
-  TPMutex taskStatusMutex{TPM};
-  std::vector<TaskStatus> taskStatuses;
+//##################################################################################################
+//! Orders the timer heap so that the task that is due first is at the front.
+struct NextRunGreater_lt
+{
+  bool operator()(const TaskDetails_lt* a, const TaskDetails_lt* b) const
+  {
+    return a->nextRunUS > b->nextRunUS;
+  }
+};
 
-  TPMutex statusChangedCallbacksMutex{TPM};
-  std::vector<const std::function<void()>*> statusChangedCallbacks;
+//##################################################################################################
+//! Ready tasks split into a FIFO per priority, the highest non-empty level is served first.
+/*!
+A task that has waited at the front of a level for longer than the aging interval is moved up to
+the next level, so low priority tasks still run while a steady stream of higher priority work is
+being added.
+*/
+struct ReadyQueue_lt
+{
+  struct Entry
+  {
+    TaskDetails_lt* taskDetails;
+    int64_t readySince;
+  };
 
-  size_t numberOfTaskThreads;
-  size_t numberOfActiveTaskThreads{0};
-  std::unique_ptr<std::thread> adminThread;
-  std::atomic_bool finish{false};
+  std::array<std::deque<Entry>, numberOfTaskPriorities> levels;
+  size_t count{0};
 
   //################################################################################################
-  Private(std::string threadName_, size_t nThreads):
-    threadName(std::move(threadName_)),
-    numberOfTaskThreads(nThreads)
+  void push(TaskDetails_lt* taskDetails, int64_t readySince)
   {
-
+    levels[size_t(taskDetails->priority())].push_back({taskDetails, readySince});
+    count++;
   }
 
   //################################################################################################
-  void taskStatusChanged()
+  TaskDetails_lt* pop(int64_t now, int64_t aging)
   {
-    TP_MUTEX_LOCKER(statusChangedCallbacksMutex);
-    for(auto c : statusChangedCallbacks)
-      (*c)();
+    if(aging>0)
+      age(now, aging);
+
+    for(size_t l=levels.size(); l>0; l--)
+    {
+      auto& level = levels[l-1];
+      if(!level.empty())
+      {
+        TaskDetails_lt* taskDetails = level.front().taskDetails;
+        level.pop_front();
+        count--;
+        return taskDetails;
+      }
+    }
+    return nullptr;
   }
 
   //################################################################################################
-  void updateWaitingMessages()
+  void age(int64_t now, int64_t aging)
   {
-    bool changed = false;
-
+    for(size_t l=0; l+1<levels.size(); l++)
     {
-      TP_MUTEX_LOCKER(mutex);
-      for(TaskDetails_lt* taskDetails : tasks)
+      auto& level = levels[l];
+      while(!level.empty() && (now - level.front().readySince)>=aging)
       {
-        if(!taskDetails->active && (taskDetails->nextRun>0 || taskDetails->task->paused()))
-        {
-          int64_t timeToRun = taskDetails->nextRun - tp_utils::currentTimeMS();
-          if(timeToRun<0)
-            taskDetails->nextRun=0;
-          timeToRun = tpMax(int64_t(0), timeToRun/1000);
-          taskStatusMutex.lock(TPM);
-          for(TaskStatus& ts : taskStatuses)
-          {
-            if(ts.taskID == taskDetails->task->taskID())
-            {
-              if(ts.paused)
-                ts.message = "Paused.";
-              else if(timeToRun==0)
-                ts.message = "Waiting for thread.";
-              else
-                ts.message = taskDetails->task->timeoutMessage() + std::to_string(timeToRun);
-              changed = true;
-              break;
-            }
-          }
-          taskStatusMutex.unlock(TPM);
-        }
+        levels[l+1].push_back({level.front().taskDetails, now});
+        level.pop_front();
       }
     }
+  }
 
-    if(changed)
-      taskStatusChanged();
+  //################################################################################################
+  //! The number of tasks above normal priority.
+  size_t urgentSize() const
+  {
+    size_t urgent=0;
+    for(size_t l=size_t(TaskPriority::Normal)+1; l<levels.size(); l++)
+      urgent += levels[l].size();
+    return urgent;
   }
 
   //################################################################################################
-  void addThreads()
+  //! Take the first task that matches, looking at no more than limit tasks from the highest level.
+  /*!
+  \param highestOnly Only look in the highest non-empty level so that priorities are kept.
+  */
+  template<typename F>
+  TaskDetails_lt* takeIf(const F& predicate, size_t limit, bool highestOnly=false)
   {
-    while(numberOfActiveTaskThreads<numberOfTaskThreads)
+    for(size_t l=levels.size(); l>0 && limit>0; l--)
     {
-      numberOfActiveTaskThreads++;
-      std::thread thread([&]()
-      {
-        lib_platform::setThreadName(threadName);
-        TPMutexLocker lock(mutex);
-        while(!finish)
-        {
-          if(numberOfActiveTaskThreads>numberOfTaskThreads)
-            break;
+      auto& level = levels[l-1];
+      if(highestOnly && level.empty())
+        continue;
 
-          bool workDone = false;
-          int64_t waitFor = INT64_MAX;
-          for(TaskDetails_lt* taskDetails : tasks)
-          {
-            if(taskDetails->active)
-              continue;
-
-            if(taskDetails->task->paused())
-              continue;
-
-            int64_t timeToRun = taskDetails->nextRun - tp_utils::currentTimeMS();
-
-            if(timeToRun<waitFor)
-              waitFor = timeToRun;
-
-            if(timeToRun>0)
-              continue;
-
-            taskDetails->active = true;
-
-            lock.unlock(TPM);
-            workDone = true;
-            auto runAgain = taskDetails->task->performTask();
-            lock.lock(TPM);
-
-            if(taskDetails->task->timeoutMS()<1 || runAgain==RunAgain::No)
-            {
-              tpRemoveOne(tasks, taskDetails);
-
-              {
-                TP_MUTEX_LOCKER(taskStatusMutex);
-                for(size_t i=0; i<taskStatuses.size(); i++)
-                {
-                  if(taskStatuses.at(i).taskID == taskDetails->task->taskID())
-                  {
-                    tpRemoveAt(taskStatuses, i);
-                    break;
-                  }
-                }
-              }
-
-              lock.unlock(TPM);
-              TaskStatus taskStatus = taskDetails->task->taskStatus();
-              taskStatus.complete = true;
-              taskDetails->task->updateTaskStatus(taskStatus);
-              delete taskDetails;
-              lock.lock(TPM);
-            }
-            else
-            {
-              if(taskDetails->task->timeoutMS()>0)
-                taskDetails->nextRun = tp_utils::currentTimeMS() + taskDetails->task->timeoutMS();
-              taskDetails->active = false;
-            }
-            break;
-          }
+      if(highestOnly)
+        limit = tpMin(limit, level.size());
 
-          if(!workDone)
-            waitCondition.wait(TPMc lock, waitFor);
+      for(auto i=level.begin(); i!=level.end() && limit>0; ++i, limit--)
+      {
+        if(predicate(i->taskDetails))
+        {
+          TaskDetails_lt* taskDetails = i->taskDetails;
+          level.erase(i);
+          count--;
+          return taskDetails;
         }
-        numberOfActiveTaskThreads--;
-        threadFinishedWaitCondition.wakeAll();
-      });
+      }
 
-      thread.detach();
+      if(highestOnly)
+        break;
     }
+    return nullptr;
+  }
+
+  //################################################################################################
+  template<typename F>
+  void forEach(const F& closure) const
+  {
+    for(const auto& level : levels)
+      for(const Entry& entry : level)
+        closure(entry.taskDetails);
+  }
+
+  //################################################################################################
+  size_t size() const
+  {
+    return count;
+  }
+
+  //################################################################################################
+  bool empty() const
+  {
+    return count==0;
   }
 };
 
 //##################################################################################################
-TaskQueue::TaskQueue(const std::string& threadName, size_t nThreads):
-  d(new Private(threadName, nThreads))
-{  
-  TP_MUTEX_LOCKER(d->mutex);
-  d->addThreads();
+//! A Chase-Lev work stealing deque.
+/*!
+Only the thread that owns the deque may call push() and pop(), these operate on the bottom of the
+deque. Any thread may call steal() to take from the top. The buffer grows as required and old
+buffers are kept until the deque is destroyed as a thief may still be reading from them.
+*/
+template<typename T>
+class WorkStealingDeque_lt
+{
+  TP_NONCOPYABLE(WorkStealingDeque_lt);
 
-  d->adminThread = std::make_unique<std::thread>([&]()
+  //################################################################################################
+  struct Buffer_lt
   {
-    lib_platform::setThreadName("#"+d->threadName);
+    int64_t capacity;
+    std::unique_ptr<std::atomic<T>[]> items;
 
-    TPMutexLocker lock(d->mutex);
-    while(!d->finish)
+    //##############################################################################################
+    Buffer_lt(int64_t capacity_):
+      capacity(capacity_),
+      items(new std::atomic<T>[size_t(capacity_)])
     {
-      d->updateWaitingMessagesWaitCondition.wait(TPMc lock, 1000);
-      {
-        TP_MUTEX_UNLOCKER(lock);
-        d->updateWaitingMessages();
-      }
+
     }
-  });
-}
 
-//##################################################################################################
-TaskQueue::~TaskQueue()
-{  
-  d->finish = true;
+    //##############################################################################################
+    T get(int64_t i) const
+    {
+      return items[size_t(i & (capacity-1))].load(std::memory_order_acquire);
+    }
+
+    //##############################################################################################
+    void put(int64_t i, T item)
+    {
+      items[size_t(i & (capacity-1))].store(item, std::memory_order_release);
+    }
+  };
+
+  std::atomic<int64_t> top{0};
+  std::atomic<int64_t> bottom{0};
+  std::atomic<Buffer_lt*> current;
+  std::vector<std::unique_ptr<Buffer_lt>> buffers;
 
+public:
+  //################################################################################################
+  WorkStealingDeque_lt()
   {
-    TPMutexLocker lock(d->mutex);
-    for(TaskDetails_lt* taskDetails : d->tasks)
-      taskDetails->task->cancelTask();
-    d->waitCondition.wakeAll();
-    while(d->numberOfActiveTaskThreads>0)
-      d->threadFinishedWaitCondition.wait(TPMc lock);
+    buffers.emplace_back(new Buffer_lt(64));
+    current = buffers.back().get();
   }
 
-  d->adminThread->join();
-  d->adminThread.reset();
+  //################################################################################################
+  //! Owner only.
+  void push(T item)
+  {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Buffer_lt* buffer = current.load(std::memory_order_relaxed);
+    if(b-t > buffer->capacity-1)
+    {
+      auto grown = new Buffer_lt(buffer->capacity*2);
+      for(int64_t i=t; i<b; i++)
+        grown->put(i, buffer->get(i));
+      buffers.emplace_back(grown);
+      buffer = grown;
+      current.store(buffer, std::memory_order_release);
+    }
+    buffer->put(b, item);
+    bottom.store(b+1, std::memory_order_release);
+  }
 
+  //################################################################################################
+  //! Owner only, returns the most recently pushed item or nullptr.
+  T pop()
   {
-    TP_MUTEX_LOCKER(d->mutex);
-    for(TaskDetails_lt* taskDetails : d->tasks)
-      delete taskDetails;
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Buffer_lt* buffer = current.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if(t>b)
+    {
+      bottom.store(b+1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    T item = buffer->get(b);
+    if(t==b)
+    {
+      if(!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        item = nullptr;
+      bottom.store(b+1, std::memory_order_relaxed);
+    }
+    return item;
   }
 
-  delete d;
+  //################################################################################################
+  //! Any thread, returns the oldest item or nullptr if empty or if another thread won the race.
+  T steal()
+  {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if(t>=b)
+      return nullptr;
+
+    Buffer_lt* buffer = current.load(std::memory_order_acquire);
+    T item = buffer->get(t);
+    if(!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed))
+      return nullptr;
+    return item;
+  }
+
+  //################################################################################################
+  //! Any thread, this is only a hint as the deque may be modified concurrently.
+  bool empty() const
+  {
+    return bottom.load(std::memory_order_seq_cst) <= top.load(std::memory_order_seq_cst);
+  }
+};
+
+//##################################################################################################
+//! Per thread state for workers in SchedulingMode::WorkStealing.
+/*!
+Workers are kept in a linked list that only grows so that thieves can walk it without the mutex,
+the slot of a worker that exits is reused by the next thread that is started.
+*/
+struct Worker_lt
+{
+  TP_NONCOPYABLE(Worker_lt);
+  Worker_lt()=default;
+
+  const void* owner{nullptr};
+  WorkStealingDeque_lt<TaskDetails_lt*> deque;
+  std::atomic<Worker_lt*> next{nullptr};
+  bool inUse{false};
+};
+
+//##################################################################################################
+//! The worker that is running on this thread, if any.
+thread_local Worker_lt* currentWorker_lt{nullptr};
+
+//##################################################################################################
+//! The TaskQueue::Private of the queue that this worker thread belongs to, if any.
+thread_local const void* currentTaskQueue_lt{nullptr};
+
+//##################################################################################################
+//! The TaskQueue::Private of the queue that this thread is running a task for in runPendingTask.
+thread_local const void* helpedTaskQueue_lt{nullptr};
+
+//! How far runPendingTask looks through the ready tasks for ones on the preferred point.
+constexpr size_t maxPreferredTaskSearch_lt=64;
+
+//! How far a worker looks through the ready tasks for ones with its NUMA node.
+constexpr size_t maxNUMATaskSearch_lt=16;
+
+//! Adaptive pools add a thread once tasks have been waiting with no idle worker for this long.
+constexpr int64_t adaptiveGrowDelayMS_lt=10;
+
+//! Adaptive pools remove a thread once it has been idle for this long.
+constexpr int64_t adaptiveIdleTimeoutMS_lt=2000;
+
+//! The most cpuRelax_lt calls between checks while a worker spins.
+constexpr size_t maxSpinBackoff_lt=64;
+
+//##################################################################################################
+//! Tell the CPU that we are in a spin loop.
+inline void cpuRelax_lt()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#else
+  std::this_thread::yield();
+#endif
 }
 
 //##################################################################################################
-size_t TaskQueue::numberOfTaskThreads() const
+//! The monotonic clock used to schedule tasks, in us.
+inline int64_t currentTimeUS_lt()
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  return d->numberOfTaskThreads;
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
 }
 
 //##################################################################################################
-void TaskQueue::setNumberOfTaskThreads(size_t numberOfTaskThreads)
+//! Convert a time until a timer is due into a wait in ms, rounding up so that it is not early.
+inline int64_t waitForMS_lt(int64_t us)
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  d->numberOfTaskThreads = numberOfTaskThreads;
-  d->addThreads();
-  d->waitCondition.wakeAll();
+  return (us<=0)?0:((us+999)/1000);
 }
 
 //##################################################################################################
-void TaskQueue::addTask(Task* task)
+//! A monotonic clock for statistics, in ns.
+inline int64_t currentTimeNS_lt()
 {
-  task->setTaskQueue(this);
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
 
-  TP_MUTEX_LOCKER(d->mutex);
-  auto taskDetails = new TaskDetails_lt();
-  taskDetails->task = task;
-  taskDetails->nextRun = tp_utils::currentTimeMS() + task->timeoutMS();
-  d->tasks.push_back(taskDetails);
-  d->waitCondition.wakeOne();
+//##################################################################################################
+//! A histogram of durations in power of two buckets of ns, updated with relaxed atomics.
+struct Histogram_lt
+{
+  static constexpr size_t numberOfBuckets=64;
+  std::array<std::atomic<uint64_t>, numberOfBuckets> buckets{};
 
-  d->taskStatusMutex.lock(TPM);
-  d->taskStatuses.push_back(taskDetails->task->taskStatus());
-  d->taskStatusMutex.unlock(TPM);
+  //################################################################################################
+  //! Bucket i holds durations below 2^i ns and at least 2^(i-1) ns.
+  void add(int64_t ns)
+  {
+    size_t i=0;
+    for(uint64_t v=uint64_t(tpMax(int64_t(0), ns)); v; v>>=1)
+      i++;
+    buckets[tpMin(i, numberOfBuckets-1)].fetch_add(1, std::memory_order_relaxed);
+  }
 
-  taskDetails->task->setStatusChangedCallback([&](const TaskStatus& taskStatus)
+  //################################################################################################
+  void addTo(std::array<uint64_t, numberOfBuckets>& counts) const
+  {
+    for(size_t i=0; i<numberOfBuckets; i++)
+      counts[i] += buckets[i].load(std::memory_order_relaxed);
+  }
+
+  //################################################################################################
+  void reset()
+  {
+    for(auto& bucket : buckets)
+      bucket.store(0, std::memory_order_relaxed);
+  }
+
+  //################################################################################################
+  //! Interpolate the value at p (0 to 1) within its bucket, in us.
+  static double percentileUS(const std::array<uint64_t, numberOfBuckets>& counts, double p)
   {
-    d->taskStatusMutex.lock(TPM);
-    for(TaskStatus& ts : d->taskStatuses)
+    uint64_t total=0;
+    for(uint64_t count : counts)
+      total += count;
+    if(total==0)
+      return 0.0;
+
+    double target = p*double(total);
+    double seen=0.0;
+    for(size_t i=0; i<numberOfBuckets; i++)
     {
-      if(ts.taskID == taskStatus.taskID)
+      if(counts[i]==0)
+        continue;
+
+      if(seen+double(counts[i])>=target)
       {
-        int64_t rev = ts.rev;
-        ts = taskStatus;
-        ts.rev = rev;
-        break;
+        double low  = (i==0)?0.0:double(uint64_t(1)<<(i-1));
+        double high = double(uint64_t(1)<<i);
+        double fraction = (target-seen)/double(counts[i]);
+        return (low + (high-low)*fraction)/1000.0;
       }
+      seen += double(counts[i]);
     }
-    d->taskStatusMutex.unlock(TPM);
-    d->taskStatusChanged();
-  });
-  d->taskStatusChanged();
-}
+    return 0.0;
+  }
+};
 
 //##################################################################################################
-void TaskQueue::cancelTask(int64_t taskID)
+//! Statistics counters that belong to one worker thread, see TaskQueue::statistics.
+/*!
+Like the workers these are kept in a list that only grows so that statistics() can read them
+while threads come and go, the slot of a thread that exits is reused along with its counts.
+*/
+struct ThreadStatistics_lt
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  for(TaskDetails_lt* taskDetails : d->tasks)
+  TP_NONCOPYABLE(ThreadStatistics_lt);
+  ThreadStatistics_lt()=default;
+
+  std::atomic<uint64_t> tasksRun{0};
+  std::atomic<uint64_t> reschedules{0};
+  std::atomic<uint64_t> wakeups{0};
+  std::atomic<int64_t> busyNS{0};
+  Histogram_lt queueWait;
+  Histogram_lt runTime;
+
+  ThreadStatistics_lt* next{nullptr};
+  bool inUse{false};
+
+  //################################################################################################
+  void reset()
   {
-    if(taskDetails->task->taskID() == taskID)
-    {
-      taskDetails->task->cancelTask();
-      d->waitCondition.wakeAll();
-      break;
-    }
+    tasksRun.store(0, std::memory_order_relaxed);
+    reschedules.store(0, std::memory_order_relaxed);
+    wakeups.store(0, std::memory_order_relaxed);
+    busyNS.store(0, std::memory_order_relaxed);
+    queueWait.reset();
+    runTime.reset();
   }
-}
+};
 
 //##################################################################################################
-void TaskQueue::pauseTask(int64_t taskID, bool paused)
+//! The statistics of the worker thread that is running on this thread, if any.
+thread_local ThreadStatistics_lt* currentThreadStatistics_lt{nullptr};
+
+//##################################################################################################
+//! The kinds of event recorded by TaskQueue::setTracingEnabled.
+enum class TraceEventType_lt : uint64_t
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  for(TaskDetails_lt* taskDetails : d->tasks)
-  {
-    if(taskDetails->task->taskID() == taskID)
-    {
-      taskDetails->task->setPaused(paused);
-      d->waitCondition.wakeAll();
-      break;
-    }
-  }
-}
+  Task,
+  Closure,
+  Parked
+};
+
+//! The number of events kept by each thread while tracing.
+constexpr size_t traceRingSize_lt=8192;
 
 //##################################################################################################
-void TaskQueue::togglePauseTask(int64_t taskID)
+//! A fixed size ring of trace events written by a single thread and readable from any thread.
+/*!
+Every field is atomic and each event is guarded by a sequence number that is odd while it is
+being written, a reader that sees the sequence change discards that event. The events are only
+allocated the first time that the thread records one.
+*/
+struct TraceRing_lt
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  for(TaskDetails_lt* taskDetails : d->tasks)
+  TP_NONCOPYABLE(TraceRing_lt);
+
+  //################################################################################################
+  struct Event
+  {
+    static constexpr size_t nameWords=6;
+
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> type{0};
+    std::atomic<int64_t> startNS{0};
+    std::atomic<int64_t> durationNS{0};
+    std::atomic<int64_t> taskID{0};
+    std::array<std::atomic<uint64_t>, nameWords> name{};
+  };
+
+  TraceRing_lt(std::string threadName_, size_t tid_):
+    threadName(std::move(threadName_)),
+    tid(tid_)
+  {
+
+  }
+
+  ~TraceRing_lt()
+  {
+    delete[] events.load();
+  }
+
+  const std::string threadName;
+  const size_t tid;
+
+  //! The thread that uses this ring if it is not a worker, guarded by the queue mutex.
+  std::thread::id helperThread;
+  bool inUse{false};
+
+  std::atomic<Event*> events{nullptr};
+  std::atomic<uint64_t> next{0};
+
+  //! Events before this were recorded before tracing was last enabled.
+  std::atomic<uint64_t> first{0};
+
+  //################################################################################################
+  //! Owner only.
+  void record(TraceEventType_lt type,
+              const std::string* name,
+              int64_t taskID,
+              int64_t startNS,
+              int64_t endNS)
   {
-    if(taskDetails->task->taskID() == taskID)
+    Event* e = events.load(std::memory_order_relaxed);
+    if(!e)
     {
-      taskDetails->task->setPaused(!taskDetails->task->paused());
-      d->waitCondition.wakeAll();
-      break;
+      e = new Event[traceRingSize_lt];
+      events.store(e, std::memory_order_release);
     }
-  }
-}
 
-//##################################################################################################
-void TaskQueue::viewTaskStatus(const std::function<void(const std::vector<TaskStatus>&)>& closure)
+    uint64_t n = next.load(std::memory_order_relaxed);
+    Event& event = e[n%traceRingSize_lt];
+
+    uint64_t seq = event.seq.load(std::memory_order_relaxed);
+    event.seq.store(seq+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    event.type.store(uint64_t(type), std::memory_order_relaxed);
+    event.startNS.store(startNS, std::memory_order_relaxed);
+    event.durationNS.store(endNS-startNS, std::memory_order_relaxed);
+    event.taskID.store(taskID, std::memory_order_relaxed);
+
+    // Names are packed into the words and truncated, a zero byte ends a shorter name.
+    size_t length = name?tpMin(name->size(), Event::nameWords*8):0;
+    for(size_t w=0; w<Event::nameWords; w++)
+    {
+      uint64_t word=0;
+      for(size_t b=0; b<8 && w*8+b<length; b++)
+        word |= uint64_t(uint8_t((*name)[w*8+b])) << (b*8);
+      event.name[w].store(word, std::memory_order_relaxed);
+    }
+
+    event.seq.store(seq+2, std::memory_order_release);
+    next.store(n+1, std::memory_order_release);
+  }
+
+  //################################################################################################
+  //! Any thread, call closure with each event that can be read consistently.
+  template<typename F>
+  void read(const F& closure) const
+  {
+    Event* e = events.load(std::memory_order_acquire);
+    if(!e)
+      return;
+
+    uint64_t end = next.load(std::memory_order_acquire);
+    uint64_t oldest = (end>traceRingSize_lt)?(end-traceRingSize_lt):0;
+    uint64_t begin = tpMax(first.load(std::memory_order_relaxed), oldest);
+    for(uint64_t i=begin; i<end; i++)
+    {
+      const Event& event = e[i%traceRingSize_lt];
+      uint64_t seq = event.seq.load(std::memory_order_acquire);
+      if(seq&1)
+        continue;
+
+      auto type = TraceEventType_lt(event.type.load(std::memory_order_relaxed));
+      int64_t startNS = event.startNS.load(std::memory_order_relaxed);
+      int64_t durationNS = event.durationNS.load(std::memory_order_relaxed);
+      int64_t taskID = event.taskID.load(std::memory_order_relaxed);
+      std::string name;
+      for(const auto& word : event.name)
+      {
+        uint64_t w = word.load(std::memory_order_relaxed);
+        for(size_t b=0; b<8; b++)
+          if(char c = char((w>>(b*8)) & 0xFF); c)
+            name.push_back(c);
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(event.seq.load(std::memory_order_relaxed)!=seq)
+        continue;
+
+      closure(type, name, taskID, startNS, durationNS);
+    }
+  }
+};
+
+//##################################################################################################
+//! The trace ring that the calling thread last used and the queue that it belongs to.
+struct CurrentTraceRing_lt
+{
+  const void* owner{nullptr};
+  TraceRing_lt* ring{nullptr};
+};
+
+thread_local CurrentTraceRing_lt currentTraceRing_lt;
+
+//##################################################################################################
+//! Append text to a JSON string, escaping as required.
+void appendJSONString_lt(std::ostream& out, const std::string& text)
+{
+  out << '"';
+  for(char c : text)
+  {
+    if(c=='"' || c=='\\')
+      out << '\\' << c;
+    else if(uint8_t(c)<0x20)
+    {
+      const char* hex = "0123456789abcdef";
+      out << "\\u00" << hex[(c>>4)&0xF] << hex[c&0xF];
+    }
+    else
+      out << c;
+  }
+  out << '"';
+}
+
+//##################################################################################################
+//! Where the worker on this thread has been placed, see TaskQueue::setThreadCPUs.
+struct WorkerPlacement_lt
+{
+  size_t slot{0};
+  uint64_t generation{0};
+  int numaNode{-1};
+};
+
+thread_local WorkerPlacement_lt currentPlacement_lt;
+
+//##################################################################################################
+//! Parse a Linux CPU list such as "0-3,8-11".
+std::vector<int> parseCPUList_lt(const std::string& text)
+{
+  std::vector<int> cpus;
+  size_t i=0;
+  while(i<text.size())
+  {
+    size_t end = text.find(',', i);
+    if(end==std::string::npos)
+      end = text.size();
+
+    std::string range = text.substr(i, end-i);
+    if(size_t dash = range.find('-'); dash!=std::string::npos)
+    {
+      int first = std::atoi(range.substr(0, dash).c_str());
+      int last  = std::atoi(range.substr(dash+1).c_str());
+      for(int cpu=first; cpu<=last; cpu++)
+        cpus.push_back(cpu);
+    }
+    else if(range.find_first_of("0123456789")!=std::string::npos)
+      cpus.push_back(std::atoi(range.c_str()));
+
+    i = end+1;
+  }
+  return cpus;
+}
+
+//##################################################################################################
+//! The CPUs of each online NUMA node, indexed by node, empty if this is not known.
+std::vector<std::vector<int>> numaNodeCPUs_lt()
+{
+  std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+  std::string online;
+  std::ifstream("/sys/devices/system/node/online") >> online;
+  for(int node : parseCPUList_lt(online))
+  {
+    std::string cpuList;
+    std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist") >> cpuList;
+    if(nodes.size()<=size_t(node))
+      nodes.resize(size_t(node)+1);
+    nodes[size_t(node)] = parseCPUList_lt(cpuList);
+  }
+#endif
+  return nodes;
+}
+
+//##################################################################################################
+//! Restrict the calling thread to cpus, or allow it to run anywhere if cpus is empty.
+void setCurrentThreadCPUs_lt(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  for(int cpu : cpus)
+    if(cpu>=0 && cpu<CPU_SETSIZE)
+      CPU_SET(cpu, &cpuSet);
+
+  if(cpus.empty())
+    for(int cpu=0; cpu<CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &cpuSet);
+
+  pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+#else
+  TP_UNUSED(cpus);
+#endif
+}
+
+}
+
+//##################################################################################################
+struct TaskQueue::Private
+{
+  TP_REF_COUNT_OBJECTS("tp_task_queue::TaskQueue::Private");
+  TP_NONCOPYABLE(Private);
+
+  std::string threadName;
+  SchedulingMode schedulingMode;
+
+  TPMutex mutex{TPM};
+  TPWaitCondition waitCondition;
+  TPWaitCondition updateWaitingMessagesWaitCondition;
+  TPWaitCondition threadFinishedWaitCondition;
+  //! All tasks owned by the queue indexed by task ID.
+  std::unordered_map<int64_t, TaskDetails_lt*> tasks;
+
+  //! Tasks that can run now, by priority and then in the order that they became runnable.
+  ReadyQueue_lt readyTasks;
+  int64_t priorityAgingMS{500};
+
+  //! Min-heap of tasks waiting for nextRunUS, ordered by NextRunGreater_lt.
+  std::vector<TaskDetails_lt*> timerTasks;
+
+  //! Tasks that were found to be paused when they came to be run.
+  std::unordered_set<TaskDetails_lt*> pausedTasks;
+
+  //! Tasks that returned RunAgain::Suspend and are waiting for resumeTask.
+  std::unordered_set<TaskDetails_lt*> suspendedTasks;
+
+  //! See TaskQueue::setConcurrencyLimit, groups are kept until the queue is destroyed.
+  std::unordered_map<std::string, std::unique_ptr<ConcurrencyGroup_lt>> concurrencyGroups;
+
+  //! Read without the mutex by work stealing workers to avoid locking when there is no shared work.
+  std::atomic<size_t> readyTasksHint{0};
+  std::atomic<size_t> urgentTasksHint{0};
+  std::atomic<int64_t> nextTimerHint{INT64_MAX}; //!< In us, see currentTimeUS_lt.
+
+  //! Recycled task records, see TaskQueue::setTaskPoolSize.
+  std::vector<TaskDetails_lt*> freeTaskDetails;
+  size_t taskPoolSize{0};
+
+  //! Worker placement, bumping placementGeneration makes each worker apply it again.
+  std::vector<int> threadCPUs;
+  bool numaPlacement{false};
+  std::vector<std::vector<int>> numaNodeCPUs;
+  std::atomic<uint64_t> placementGeneration{0};
+  size_t nextThreadSlot{0};
+
+  //! Head of the list of work stealing workers, this only grows.
+  std::atomic<Worker_lt*> workers{nullptr};
+
+  //! See TaskQueue::setStatisticsEnabled, threadStatistics only grows and is guarded by mutex.
+  std::atomic_bool statisticsEnabled{false};
+  std::atomic<int64_t> statisticsSinceNS{0};
+  ThreadStatistics_lt* threadStatistics{nullptr};
+
+  //! Used by threads that are not workers of this queue, such as callers of runPendingTask.
+  ThreadStatistics_lt helperStatistics;
+
+  //! See TaskQueue::setTracingEnabled, traceRings only grows and is guarded by mutex.
+  std::atomic_bool tracingEnabled{false};
+  std::vector<std::unique_ptr<TraceRing_lt>> traceRings;
+
+  TPMutex taskStatusMutex{TPM};
+  //! Statuses in the order that the tasks were added, removed entries are left in place until
+  //! compactTaskStatuses runs.
+  std::vector<TaskStatus> taskStatuses;
+  std::vector<TaskDetails_lt*> taskStatusDetails; //!< The owner of each entry, nullptr if removed.
+  size_t removedTaskStatusSlots{0};               //!< The number of nullptr in taskStatusDetails.
+
+  //! Bumped for every change to taskStatuses, each entry records the value from its last change.
+  int64_t statusRevision{0};
+
+  //! The ends of the list of statuses in revision order, see touchTaskStatus.
+  TaskDetails_lt* oldestStatus{nullptr};
+  TaskDetails_lt* newestStatus{nullptr};
+
+  //! The revision at which each status was removed, used by taskStatusChangesSince.
+  std::deque<std::pair<int64_t, int64_t>> removedTaskStatuses;
+
+  //! Changes before this revision are no longer tracked in removedTaskStatuses.
+  int64_t removedTaskStatusesHorizon{0};
+
+  //! The last snapshot handed out by taskStatusSnapshot, reused until the revision changes.
+  std::shared_ptr<const std::vector<TaskStatus>> taskStatusSnapshot;
+  int64_t taskStatusSnapshotRevision{-1};
+
+  TPMutex statusChangedCallbacksMutex{TPM};
+  std::vector<const std::function<void()>*> statusChangedCallbacks;
+
+  //! If positive status changes are coalesced and sent by the admin thread at this interval.
+  std::atomic<int64_t> statusChangedInterval{0};
+  std::atomic_bool statusChangedPending{false};
+
+  size_t numberOfTaskThreads;
+  size_t numberOfActiveTaskThreads{0};
+
+  //! See TaskQueue::setAdaptiveThreads, maximumThreads is zero if the pool is not adaptive.
+  size_t minimumThreads{0};
+  size_t maximumThreads{0};
+  int64_t backlogSince{0};
+
+  //! Workers spin for this long before parking, see TaskQueue::setIdleSpinUS.
+  std::atomic<int64_t> idleSpinUS{20};
+  std::atomic<size_t> spinningThreads{0};
+  size_t idleThreads{0};
+  std::unique_ptr<std::thread> adminThread;
+  bool stopAdminThread{false};
+  std::atomic_bool adminThreadRunning{false};
+  std::atomic_bool finish{false};
+
+  //! See TaskQueue::shutdown, workers signal threadFinishedWaitCondition as they go idle once set.
+  bool shuttingDown{false};
+  size_t helperTasksRunning{0}; //!< Tasks being run by runPendingTask.
+  size_t helpersWaiting{0};     //!< Threads in waitForPendingTask.
+
+  //! Worker threads by slot. A worker that exits moves its thread to exitedWorkerThread and joins
+  //! the one that exited before it, so at most one has to be joined by shutdown.
+  std::unordered_map<size_t, std::thread> workerThreads;
+  std::thread exitedWorkerThread;
+
+  //################################################################################################
+  Private(std::string threadName_, size_t nThreads, SchedulingMode schedulingMode_):
+    threadName(std::move(threadName_)),
+    schedulingMode(schedulingMode_),
+    numberOfTaskThreads(nThreads)
+  {
+
+  }
+
+  //################################################################################################
+  ~Private()
+  {
+    for(TaskDetails_lt* taskDetails : freeTaskDetails)
+      delete taskDetails;
+
+    Worker_lt* worker = workers.load();
+    while(worker)
+    {
+      Worker_lt* next = worker->next.load();
+      delete worker;
+      worker = next;
+    }
+
+    while(threadStatistics)
+    {
+      ThreadStatistics_lt* next = threadStatistics->next;
+      delete threadStatistics;
+      threadStatistics = next;
+    }
+  }
+
+  //################################################################################################
+  void taskStatusChanged()
+  {
+    if(statusChangedInterval.load(std::memory_order_relaxed)>0 &&
+       adminThreadRunning.load(std::memory_order_relaxed))
+    {
+      statusChangedPending.store(true, std::memory_order_relaxed);
+      return;
+    }
+
+    notifyStatusChanged();
+  }
+
+  //################################################################################################
+  void notifyStatusChanged()
+  {
+    TP_MUTEX_LOCKER(statusChangedCallbacksMutex);
+    for(auto c : statusChangedCallbacks)
+      (*c)();
+  }
+
+  //################################################################################################
+  //! Show how long each waiting task has left, only statuses whose message changes are touched.
+  void updateWaitingMessages()
+  {
+    bool changed = false;
+
+    {
+      TP_MUTEX_LOCKER(mutex);
+      TP_MUTEX_LOCKER(taskStatusMutex);
+      int64_t now = currentTimeUS_lt();
+
+      auto update = [&](TaskDetails_lt* taskDetails)
+      {
+        if(!taskDetails->task || taskDetails->statusIndex>=taskStatuses.size())
+          return;
+
+        int64_t waitingMessage = -2;
+        if(!taskDetails->task->paused())
+          waitingMessage = tpMax(int64_t(0), (taskDetails->nextRunUS-now)/1000000);
+        if(waitingMessage == taskDetails->waitingMessage)
+          return;
+
+        taskDetails->waitingMessage = waitingMessage;
+        TaskStatus& ts = taskStatuses[taskDetails->statusIndex];
+        // The task's own message is copied back the next time that it updates its status.
+        taskDetails->messageRevision = -1;
+        if(waitingMessage==-2)
+          ts.message = "Paused.";
+        else if(waitingMessage==0)
+          ts.message = "Waiting for thread.";
+        else
+          ts.message = taskDetails->task->timeoutMessage() + std::to_string(waitingMessage);
+        touchTaskStatus(taskDetails);
+        changed = true;
+      };
+
+      readyTasks.forEach(update);
+
+      for(TaskDetails_lt* taskDetails : timerTasks)
+        update(taskDetails);
+
+      for(TaskDetails_lt* taskDetails : pausedTasks)
+        update(taskDetails);
+    }
+
+    if(changed)
+      taskStatusChanged();
+  }
+
+  //################################################################################################
+  //! Refreshes waiting messages, adapts the pool and sends coalesced notifications.
+  void runAdminThread()
+  {
+    lib_platform::setThreadName("#"+threadName);
+
+    TPMutexLocker lock(mutex);
+    int64_t nextUpdate = tp_utils::currentTimeMS() + 1000;
+    while(!finish && !stopAdminThread)
+    {
+      int64_t waitFor = nextUpdate - tp_utils::currentTimeMS();
+      if(int64_t interval = statusChangedInterval; interval>0)
+        waitFor = tpMin(waitFor, interval);
+      if(backlogSince!=0)
+        waitFor = tpMin(waitFor, backlogSince + adaptiveGrowDelayMS_lt - tp_utils::currentTimeMS());
+      if(waitFor>0)
+        updateWaitingMessagesWaitCondition.wait(TPMc lock, waitFor);
+
+      int64_t now = tp_utils::currentTimeMS();
+      if(backlogSince!=0 && now-backlogSince>=adaptiveGrowDelayMS_lt)
+        adaptThreads(now);
+
+      if(now>=nextUpdate)
+      {
+        nextUpdate = now + 1000;
+        adaptThreads(now);
+        {
+          TP_MUTEX_UNLOCKER(lock);
+          updateWaitingMessages();
+        }
+      }
+
+      if(statusChangedPending.exchange(false))
+      {
+        TP_MUTEX_UNLOCKER(lock);
+        notifyStatusChanged();
+      }
+    }
+
+    // Once stopped notifications are synchronous, deliver one that came in while this was stopping.
+    if(statusChangedPending.exchange(false))
+    {
+      TP_MUTEX_UNLOCKER(lock);
+      notifyStatusChanged();
+    }
+  }
+
+  //################################################################################################
+  //! Call with mutex locked.
+  bool onAdminThread() const
+  {
+    return adminThread && adminThread->get_id()==std::this_thread::get_id();
+  }
+
+  //################################################################################################
+  //! True on a worker, the admin thread or a thread running a task in runPendingTask.
+  /*!
+  Call with mutex locked. shutdown waits for all of these so it can't be called from them.
+  */
+  bool onQueueThread() const
+  {
+    return currentTaskQueue_lt==this || helpedTaskQueue_lt==this || onAdminThread();
+  }
+
+  //################################################################################################
+  //! Call with mutex locked, this may unlock to join an admin thread that was stopped from itself.
+  void startAdminThread(TPMutexLocker& lock)
+  {
+    // Re-enabled from a callback on the admin thread before it had a chance to exit.
+    if(onAdminThread())
+    {
+      stopAdminThread = false;
+      adminThreadRunning = true;
+      return;
+    }
+
+    if(adminThread && !stopAdminThread)
+      return;
+
+    joinAdminThread(lock);
+    if(adminThread)
+      return;
+
+    stopAdminThread = false;
+    adminThreadRunning = true;
+    adminThread = std::make_unique<std::thread>([&]{runAdminThread();});
+  }
+
+  //################################################################################################
+  //! Call with mutex locked, this will unlock while it waits for the thread to exit.
+  void joinAdminThread(TPMutexLocker& lock)
+  {
+    if(!adminThread)
+      return;
+
+    stopAdminThread = true;
+    adminThreadRunning = false;
+    updateWaitingMessagesWaitCondition.wakeAll();
+
+    // The admin thread can't join itself. It exits once the callback that stopped it returns and is
+    // joined by the next call to this from another thread, which shutdown always makes.
+    if(onAdminThread())
+      return;
+
+    std::unique_ptr<std::thread> thread;
+    thread.swap(adminThread);
+    lock.unlock(TPM);
+    thread->join();
+    lock.lock(TPM);
+
+    // Deliver anything that was waiting on the admin thread.
+    if(statusChangedPending.exchange(false))
+    {
+      TP_MUTEX_UNLOCKER(lock);
+      notifyStatusChanged();
+    }
+  }
+
+  //################################################################################################
+  //! Queue a task that is not active, either on the ready queue or on the timer heap.
+  /*!
+  Call with mutex locked.
+  \param now The time from currentTimeUS_lt.
+  \return True if a parked worker needs to be woken, because the task is ready or because it is
+  now the first timer that is due and the workers are waiting for a later one.
+  */
+  bool scheduleTask(TaskDetails_lt* taskDetails, int64_t now)
+  {
+    bool wake=true;
+    if(taskDetails->nextRunUS<=now)
+    {
+      markReady(taskDetails, 0);
+      readyTasks.push(taskDetails, now);
+    }
+    else
+    {
+      timerTasks.push_back(taskDetails);
+      std::push_heap(timerTasks.begin(), timerTasks.end(), NextRunGreater_lt());
+      wake = (timerTasks.front()==taskDetails);
+    }
+    updateSchedulerHints();
+    return wake;
+  }
+
+  //################################################################################################
+  //! Record when a task became ready for the queue wait statistics.
+  /*!
+  \param lateUS How long ago the task was actually due, for timers that are noticed late.
+  */
+  void markReady(TaskDetails_lt* taskDetails, int64_t lateUS)
+  {
+    if(statisticsEnabled.load(std::memory_order_relaxed))
+      taskDetails->readySinceNS = currentTimeNS_lt() - lateUS*1000;
+    else
+      taskDetails->readySinceNS = 0;
+  }
+
+  //################################################################################################
+  //! The statistics counters for the calling thread.
+  ThreadStatistics_lt* statisticsForThisThread()
+  {
+    if(currentTaskQueue_lt==this && currentThreadStatistics_lt)
+      return currentThreadStatistics_lt;
+    return &helperStatistics;
+  }
+
+  //################################################################################################
+  //! Claim a free statistics slot for a new worker thread, call with mutex locked.
+  ThreadStatistics_lt* claimThreadStatistics()
+  {
+    for(ThreadStatistics_lt* s=threadStatistics; s; s=s->next)
+    {
+      if(!s->inUse)
+      {
+        s->inUse = true;
+        return s;
+      }
+    }
+
+    auto s = new ThreadStatistics_lt();
+    s->inUse = true;
+    s->next = threadStatistics;
+    threadStatistics = s;
+    return s;
+  }
+
+  //################################################################################################
+  //! Claim a trace ring for a worker thread or find the one for a helper, call with mutex locked.
+  /*!
+  The ring is also stored in currentTraceRing_lt for traceRing.
+  */
+  TraceRing_lt* claimTraceRing(bool worker)
+  {
+    std::thread::id helperThread = worker?std::thread::id():std::this_thread::get_id();
+    TraceRing_lt* ring{nullptr};
+    for(const auto& r : traceRings)
+    {
+      if(worker?(!r->inUse && r->helperThread==std::thread::id()):(r->helperThread==helperThread))
+      {
+        ring = r.get();
+        break;
+      }
+    }
+
+    if(!ring)
+    {
+      auto newRing = new TraceRing_lt(worker?threadName:"helper", traceRings.size()+1);
+      ring = traceRings.emplace_back(newRing).get();
+      ring->helperThread = helperThread;
+    }
+
+    ring->inUse = true;
+    currentTraceRing_lt.owner = this;
+    currentTraceRing_lt.ring = ring;
+    return ring;
+  }
+
+  //################################################################################################
+  //! The trace ring of the calling thread, nullptr if tracing is disabled.
+  /*!
+  Worker threads claim their ring as they start, other threads must have called claimTraceRing.
+  */
+  TraceRing_lt* traceRing()
+  {
+    if(!tracingEnabled.load(std::memory_order_relaxed) || currentTraceRing_lt.owner!=this)
+      return nullptr;
+    return currentTraceRing_lt.ring;
+  }
+
+  //################################################################################################
+  //! Run a task that has been taken from the scheduler, call with mutex unlocked.
+  RunAgain runTask(TaskDetails_lt* taskDetails)
+  {
+    bool statistics = statisticsEnabled.load(std::memory_order_relaxed);
+    TraceRing_lt* ring = traceRing();
+    if(!statistics && !ring)
+      return taskDetails->run();
+
+    int64_t start = currentTimeNS_lt();
+
+    // The task may be deleted by the time that it returns so take what the trace needs now.
+    bool isTask = taskDetails->task!=nullptr;
+    std::string name;
+    int64_t taskID=0;
+    if(ring && isTask)
+    {
+      name = taskDetails->task->taskName();
+      taskID = taskDetails->task->taskID();
+    }
+
+    auto runAgain = taskDetails->run();
+    int64_t end = currentTimeNS_lt();
+
+    if(ring)
+    {
+      if(isTask)
+        ring->record(TraceEventType_lt::Task, &name, taskID, start, end);
+      else
+        ring->record(TraceEventType_lt::Closure, nullptr, 0, start, end);
+    }
+
+    if(statistics)
+    {
+      ThreadStatistics_lt* s = statisticsForThisThread();
+      if(taskDetails->readySinceNS>0)
+        s->queueWait.add(start - taskDetails->readySinceNS);
+
+      int64_t runTime = end - start;
+      s->runTime.add(runTime);
+      s->busyNS.fetch_add(runTime, std::memory_order_relaxed);
+      s->tasksRun.fetch_add(1, std::memory_order_relaxed);
+    }
+    return runAgain;
+  }
+
+  //################################################################################################
+  //! Call with mutex locked after modifying readyTasks or timerTasks.
+  void updateSchedulerHints()
+  {
+    readyTasksHint.store(readyTasks.size(), std::memory_order_relaxed);
+    urgentTasksHint.store(readyTasks.urgentSize(), std::memory_order_relaxed);
+    int64_t nextTimer = timerTasks.empty()?INT64_MAX:timerTasks.front()->nextRunUS;
+    nextTimerHint.store(nextTimer, std::memory_order_relaxed);
+  }
+
+  //################################################################################################
+  //! Park a task that is paused until it is un-paused, call with mutex locked.
+  /*!
+  \return False if the task was un-paused while it was being parked, it is then not parked.
+  */
+  bool parkTask(TaskDetails_lt* taskDetails)
+  {
+    pausedTasks.insert(taskDetails);
+    taskDetails->parked = true;
+
+    // Task::setPaused clears paused before its status changed callback reads parked, so either
+    // the callback requeues the task or this sees that it is no longer paused.
+    if(taskDetails->paused())
+      return true;
+
+    unparkTask(taskDetails);
+    return false;
+  }
+
+  //################################################################################################
+  //! Take a task out of pausedTasks, call with mutex locked.
+  /*!
+  \return True if the task was parked.
+  */
+  bool unparkTask(TaskDetails_lt* taskDetails)
+  {
+    if(!pausedTasks.erase(taskDetails))
+      return false;
+
+    taskDetails->parked = false;
+    return true;
+  }
+
+  //################################################################################################
+  //! Return a single task to the scheduler if it is parked and no longer paused.
+  /*!
+  Call with mutex locked. A task that has not been parked is still queued and needs nothing.
+  \return True if a worker should be woken for the task.
+  */
+  bool requeueIfUnpaused(TaskDetails_lt* taskDetails)
+  {
+    if(!taskDetails->task->paused() && unparkTask(taskDetails))
+      return scheduleTask(taskDetails, currentTimeUS_lt());
+    return false;
+  }
+
+  //################################################################################################
+  //! Pause or un-pause a task for pauseTask and togglePauseTask, call with mutex locked.
+  void setTaskPaused(TaskDetails_lt* taskDetails, bool paused)
+  {
+    // The task is unparked first so that its status changed callback does not try to take the
+    // mutex that is held here.
+    bool parked = !paused && unparkTask(taskDetails);
+    taskDetails->task->setPaused(paused);
+    if(parked && scheduleTask(taskDetails, currentTimeUS_lt()))
+      wakeWorker();
+  }
+
+  //################################################################################################
+  //! Take the next runnable task or calculate how long to wait for one.
+  /*!
+  Call with mutex locked. Due timers are moved onto the ready queue and paused tasks are parked in
+  pausedTasks until they are un-paused.
+
+  \param waitFor Set to the time in ms until the next timer is due, if no task is returned.
+  \return The next task to run or nullptr.
+  */
+  TaskDetails_lt* takeNextTask(int64_t& waitFor)
+  {
+    int64_t now = currentTimeUS_lt();
+    int64_t aging = priorityAgingMS*1000;
+    while(!timerTasks.empty() && timerTasks.front()->nextRunUS<=now)
+    {
+      std::pop_heap(timerTasks.begin(), timerTasks.end(), NextRunGreater_lt());
+      // Periodic tasks age from the time that they were due, not from when a worker noticed.
+      markReady(timerTasks.back(), now - timerTasks.back()->nextRunUS);
+      readyTasks.push(timerTasks.back(), timerTasks.back()->nextRunUS);
+      timerTasks.pop_back();
+    }
+
+    // Prefer tasks for this worker's NUMA node from the highest priority that has any.
+    if(int numaNode = currentPlacement_lt.numaNode; numaNode>=0 && numaPlacement)
+    {
+      readyTasks.age(now, aging);
+      TaskDetails_lt* taskDetails = readyTasks.takeIf([&](TaskDetails_lt* candidate)
+      {
+        return candidate->task &&
+               candidate->task->numaNode()==numaNode &&
+               !candidate->paused() &&
+               !(candidate->group && candidate->group->full());
+      }, maxNUMATaskSearch_lt, true);
+
+      if(taskDetails)
+      {
+        admitTask(taskDetails);
+        updateSchedulerHints();
+        return taskDetails;
+      }
+    }
+
+    while(TaskDetails_lt* taskDetails = readyTasks.pop(now, aging))
+    {
+      if(taskDetails->paused() && parkTask(taskDetails))
+        continue;
+
+      if(!admitTask(taskDetails))
+        continue;
+
+      updateSchedulerHints();
+      return taskDetails;
+    }
+
+    updateSchedulerHints();
+    waitFor = timerTasks.empty()?INT64_MAX:waitForMS_lt(timerTasks.front()->nextRunUS - now);
+    return nullptr;
+  }
+
+  //################################################################################################
+  //! Take a slot in the task's concurrency group, or set it aside if the group is full.
+  /*!
+  Call with mutex locked.
+  \return True if the task can be run now.
+  */
+  bool admitTask(TaskDetails_lt* taskDetails)
+  {
+    ConcurrencyGroup_lt* group = taskDetails->group;
+    if(!group)
+      return true;
+
+    if(group->full())
+    {
+      group->waiting.push_back(taskDetails);
+      return false;
+    }
+
+    group->active++;
+    taskDetails->groupSlot = true;
+    return true;
+  }
+
+  //################################################################################################
+  //! Give up the group slot of a task that has stopped running, call with mutex locked.
+  /*!
+  The next task that was set aside for the group, if any, goes back on the ready queue.
+  */
+  void releaseGroupSlot(TaskDetails_lt* taskDetails)
+  {
+    if(!taskDetails->groupSlot)
+      return;
+
+    taskDetails->groupSlot = false;
+    ConcurrencyGroup_lt* group = taskDetails->group;
+    group->active--;
+    if(requeueWaitingTasks(group))
+      wakeWorker();
+  }
+
+  //################################################################################################
+  //! Move tasks that were set aside back to the ready queue while the group has room.
+  /*!
+  Call with mutex locked.
+  \return The number of tasks that were requeued.
+  */
+  size_t requeueWaitingTasks(ConcurrencyGroup_lt* group)
+  {
+    size_t room = group->waiting.size();
+    if(group->maxActive>0)
+      room = group->maxActive - tpMin(group->maxActive, group->active);
+    size_t requeued = tpMin(room, group->waiting.size());
+    int64_t now = currentTimeUS_lt();
+    for(size_t i=0; i<requeued; i++)
+    {
+      readyTasks.push(group->waiting.front(), now);
+      group->waiting.pop_front();
+    }
+
+    if(requeued)
+      updateSchedulerHints();
+    return requeued;
+  }
+
+  //################################################################################################
+  //! Park a task that was taken to run but turned out to be paused, call with mutex locked.
+  void parkPausedTask(TaskDetails_lt* taskDetails)
+  {
+    releaseGroupSlot(taskDetails);
+    if(!parkTask(taskDetails))
+      scheduleTask(taskDetails, currentTimeUS_lt());
+  }
+
+  //################################################################################################
+  //! Push a ready task onto the deque of the calling worker if it belongs to this queue.
+  /*!
+  Call with mutex locked. Local deques are not ordered by priority so tasks above normal priority
+  always go through the shared queue, as do tasks in a concurrency group so that their limit is
+  checked.
+  \return True if the task was queued on a local deque.
+  */
+  bool pushLocalTask(TaskDetails_lt* taskDetails, int64_t now)
+  {
+    if(schedulingMode != SchedulingMode::WorkStealing || taskDetails->nextRunUS>now)
+      return false;
+
+    if(taskDetails->priority()>TaskPriority::Normal || taskDetails->group)
+      return false;
+
+    Worker_lt* worker = currentWorker_lt;
+    if(!worker || worker->owner != this)
+      return false;
+
+    markReady(taskDetails, 0);
+    worker->deque.push(taskDetails);
+    return true;
+  }
+
+  //################################################################################################
+  //! Try to take a task from the deque of any other worker.
+  TaskDetails_lt* stealTask(Worker_lt* thief)
+  {
+    for(int pass=0; pass<2; pass++)
+    {
+      Worker_lt* worker = (pass==0)?thief->next.load():workers.load();
+      Worker_lt* end    = (pass==0)?nullptr:thief;
+      for(; worker!=end; worker=worker->next.load())
+        if(TaskDetails_lt* taskDetails = worker->deque.steal(); taskDetails)
+          return taskDetails;
+    }
+    return nullptr;
+  }
+
+  //################################################################################################
+  //! Find a task for a work stealing worker, call with mutex unlocked.
+  /*!
+  The local deque is checked first then the shared ready queue, the mutex is only taken if the
+  hints suggest that there is shared work. Finally other workers are robbed.
+
+  \param preferShared Check the shared queue before the local deque, used periodically so that
+  tasks added from outside the pool are not starved by a worker that keeps feeding its own deque,
+  this is also forced while there are tasks above normal priority waiting.
+  */
+  TaskDetails_lt* findWorkStealingTask(Worker_lt* worker, bool preferShared)
+  {
+    if(urgentTasksHint.load(std::memory_order_relaxed)>0)
+      preferShared = true;
+
+    TaskDetails_lt* taskDetails{nullptr};
+    if(!preferShared)
+      taskDetails = worker->deque.pop();
+
+    if(!taskDetails && (readyTasksHint.load(std::memory_order_relaxed)>0 ||
+                        nextTimerHint.load(std::memory_order_relaxed)<=currentTimeUS_lt()))
+    {
+      TP_MUTEX_LOCKER(mutex);
+      int64_t waitFor = INT64_MAX;
+      taskDetails = takeNextTask(waitFor);
+    }
+
+    if(!taskDetails && preferShared)
+      taskDetails = worker->deque.pop();
+
+    if(!taskDetails)
+      taskDetails = stealTask(worker);
+
+    return taskDetails;
+  }
+
+  //################################################################################################
+  //! Take a ready task for TaskQueue::runPendingTask, call with mutex locked.
+  TaskDetails_lt* takePendingTask(const SynchronizationPoint* preferred)
+  {
+    if(preferred)
+    {
+      TaskDetails_lt* taskDetails = readyTasks.takeIf([&](TaskDetails_lt* candidate)
+      {
+        return candidate->task &&
+               candidate->task->synchronizationPoint()==preferred &&
+               !candidate->paused() &&
+               !(candidate->group && candidate->group->full());
+      }, maxPreferredTaskSearch_lt);
+
+      if(taskDetails)
+      {
+        admitTask(taskDetails);
+        updateSchedulerHints();
+        return taskDetails;
+      }
+    }
+
+    Worker_lt* worker = (schedulingMode==SchedulingMode::WorkStealing)?currentWorker_lt:nullptr;
+    if(worker && worker->owner!=this)
+      worker = nullptr;
+
+    for(int source=0; source<3; source++)
+    {
+      TaskDetails_lt* taskDetails{nullptr};
+      if(source==0 && worker)
+        taskDetails = worker->deque.pop();
+      else if(source==1)
+      {
+        int64_t waitFor = INT64_MAX;
+        taskDetails = takeNextTask(waitFor);
+      }
+      else if(source==2 && schedulingMode==SchedulingMode::WorkStealing)
+      {
+        for(Worker_lt* w=workers.load(); w && !taskDetails; w=w->next.load())
+          if(w!=worker)
+            taskDetails = w->deque.steal();
+      }
+
+      if(!taskDetails)
+        continue;
+
+      if(taskDetails->paused())
+      {
+        parkPausedTask(taskDetails);
+        source--;
+        continue;
+      }
+
+      return taskDetails;
+    }
+
+    return nullptr;
+  }
+
+  //################################################################################################
+  //! Returns true if any worker deque may contain work, call with mutex locked.
+  bool workerDequesHaveTasks()
+  {
+    for(Worker_lt* worker=workers.load(); worker; worker=worker->next.load())
+      if(!worker->deque.empty())
+        return true;
+    return false;
+  }
+
+  //################################################################################################
+  //! Claim a free worker slot for a new thread, call with mutex locked.
+  Worker_lt* claimWorker()
+  {
+    for(Worker_lt* worker=workers.load(); worker; worker=worker->next.load())
+    {
+      if(!worker->inUse)
+      {
+        worker->inUse = true;
+        return worker;
+      }
+    }
+
+    auto worker = new Worker_lt();
+    worker->owner = this;
+    worker->inUse = true;
+    worker->next.store(workers.load());
+    workers.store(worker);
+    return worker;
+  }
+
+  //################################################################################################
+  //! Create the details for a task and add it to the index, call with mutex locked.
+  /*!
+  The task must be given a status and callback before it is queued with queueTask as once it has
+  been pushed onto a worker deque it can be stolen without the mutex.
+  */
+  TaskDetails_lt* createTaskDetails(Task* task, int64_t now)
+  {
+    auto taskDetails = acquireTaskDetails();
+    taskDetails->task = task;
+    taskDetails->nextRunUS = now + task->timeoutMS()*1000;
+    if(const std::string& group = task->concurrencyGroup(); !group.empty())
+      taskDetails->group = concurrencyGroup(group);
+    tasks[task->taskID()] = taskDetails;
+    return taskDetails;
+  }
+
+  //################################################################################################
+  //! Find or create a concurrency group, call with mutex locked.
+  ConcurrencyGroup_lt* concurrencyGroup(const std::string& name)
+  {
+    auto& group = concurrencyGroups[name];
+    if(!group)
+      group = std::make_unique<ConcurrencyGroup_lt>();
+    return group.get();
+  }
+
+  //################################################################################################
+  //! Append the status of a new task, call with taskStatusMutex locked.
+  void addTaskStatus(TaskDetails_lt* taskDetails)
+  {
+    taskDetails->statusIndex = taskStatuses.size();
+    taskDetails->messageRevision = -1;
+    taskDetails->task->copyTaskStatus(taskStatuses.emplace_back(), taskDetails->messageRevision);
+    taskStatusDetails.push_back(taskDetails);
+    touchTaskStatus(taskDetails);
+  }
+
+  //################################################################################################
+  //! Bump the revision of a status and move it to the newest end, call with taskStatusMutex locked.
+  /*!
+  Keeping the statuses in revision order lets taskStatusChangesSince walk back from the newest
+  rather than scanning every status.
+  */
+  void touchTaskStatus(TaskDetails_lt* taskDetails)
+  {
+    taskStatuses[taskDetails->statusIndex].rev = ++statusRevision;
+    if(newestStatus==taskDetails)
+      return;
+
+    unlinkTaskStatus(taskDetails);
+    taskDetails->olderStatus = newestStatus;
+    if(newestStatus)
+      newestStatus->newerStatus = taskDetails;
+    else
+      oldestStatus = taskDetails;
+    newestStatus = taskDetails;
+  }
+
+  //################################################################################################
+  //! Take a status out of the revision order list, call with taskStatusMutex locked.
+  void unlinkTaskStatus(TaskDetails_lt* taskDetails)
+  {
+    if(taskDetails->olderStatus)
+      taskDetails->olderStatus->newerStatus = taskDetails->newerStatus;
+    else if(oldestStatus==taskDetails)
+      oldestStatus = taskDetails->newerStatus;
+
+    if(taskDetails->newerStatus)
+      taskDetails->newerStatus->olderStatus = taskDetails->olderStatus;
+    else if(newestStatus==taskDetails)
+      newestStatus = taskDetails->olderStatus;
+
+    taskDetails->olderStatus = nullptr;
+    taskDetails->newerStatus = nullptr;
+  }
+
+  //################################################################################################
+  //! Route status updates from the task to its entry in taskStatuses.
+  void installStatusChangedCallback(TaskDetails_lt* taskDetails)
+  {
+    taskDetails->task->setTaskStatusChangedCallback([this, taskDetails](const Task& task)
+    {
+      taskStatusMutex.lock(TPM);
+      if(taskDetails->statusIndex<taskStatuses.size())
+      {
+        task.copyTaskStatus(taskStatuses[taskDetails->statusIndex], taskDetails->messageRevision);
+        touchTaskStatus(taskDetails);
+      }
+      taskStatusMutex.unlock(TPM);
+
+      // Task::setPaused comes through here so an un-paused task is requeued straight away.
+      if(taskDetails->parked && !task.paused())
+      {
+        TP_MUTEX_LOCKER(mutex);
+        if(requeueIfUnpaused(taskDetails))
+          wakeWorker();
+      }
+
+      taskStatusChanged();
+    });
+  }
+
+  //################################################################################################
+  //! Queue a new task on the local deque or the shared scheduler, call with mutex locked.
+  void queueTask(TaskDetails_lt* taskDetails, int64_t now)
+  {
+    if(!pushLocalTask(taskDetails, now))
+      scheduleTask(taskDetails, now);
+  }
+
+  //################################################################################################
+  //! Take a TaskDetails_lt from the pool or allocate a new one, call with mutex locked.
+  TaskDetails_lt* acquireTaskDetails()
+  {
+    if(freeTaskDetails.empty())
+      return new TaskDetails_lt();
+
+    TaskDetails_lt* taskDetails = freeTaskDetails.back();
+    freeTaskDetails.pop_back();
+    return taskDetails;
+  }
+
+  //################################################################################################
+  //! Return a TaskDetails_lt to the pool, call with mutex locked and the task already deleted.
+  void releaseTaskDetails(TaskDetails_lt* taskDetails)
+  {
+    if(freeTaskDetails.size()>=taskPoolSize)
+    {
+      delete taskDetails;
+      return;
+    }
+
+    taskDetails->task = nullptr;
+    taskDetails->nextRunUS = 0;
+    taskDetails->active = false;
+    taskDetails->waitingMessage = -1;
+    taskDetails->group = nullptr;
+    taskDetails->groupSlot = false;
+    taskDetails->resumeAtUS = -1;
+    taskDetails->suspended = false;
+    taskDetails->readySinceNS = 0;
+    taskDetails->statusIndex = SIZE_MAX;
+    freeTaskDetails.push_back(taskDetails);
+  }
+
+  //################################################################################################
+  //! Remove the status of a task, leaving its slot empty so that the order of the rest is kept.
+  void removeTaskStatus(TaskDetails_lt* taskDetails)
+  {
+    TP_MUTEX_LOCKER(taskStatusMutex);
+    size_t index = taskDetails->statusIndex;
+    if(index>=taskStatuses.size())
+      return;
+
+    unlinkTaskStatus(taskDetails);
+    removedTaskStatuses.emplace_back(++statusRevision, taskStatuses[index].taskID);
+    if(removedTaskStatuses.size()>maxRemovedTaskStatuses_lt)
+    {
+      removedTaskStatusesHorizon = removedTaskStatuses.front().first;
+      removedTaskStatuses.pop_front();
+    }
+
+    taskStatusDetails[index] = nullptr;
+    removedTaskStatusSlots++;
+    taskDetails->statusIndex = SIZE_MAX;
+
+    // Compacting once half of the slots are empty keeps removal O(1) amortized.
+    if(removedTaskStatusSlots*2 > taskStatuses.size())
+      compactTaskStatuses();
+  }
+
+  //################################################################################################
+  //! Close up the slots of removed statuses keeping the order, call with taskStatusMutex locked.
+  void compactTaskStatuses()
+  {
+    if(removedTaskStatusSlots==0)
+      return;
+
+    size_t live=0;
+    for(size_t i=0; i<taskStatuses.size(); i++)
+    {
+      TaskDetails_lt* owner = taskStatusDetails[i];
+      if(!owner)
+        continue;
+
+      if(live!=i)
+      {
+        taskStatuses[live] = std::move(taskStatuses[i]);
+        taskStatusDetails[live] = owner;
+        owner->statusIndex = live;
+      }
+      live++;
+    }
+
+    taskStatuses.resize(live);
+    taskStatusDetails.resize(live);
+    removedTaskStatusSlots = 0;
+  }
+
+  //################################################################################################
+  //! Complete or reschedule a task after it has been run, call with mutex locked.
+  void finishTask(TPMutexLocker& lock, TaskDetails_lt* taskDetails, RunAgain runAgain)
+  {
+    releaseGroupSlot(taskDetails);
+
+    // Read once as Task::setTimeoutMS can change it from another thread.
+    int64_t periodUS = taskDetails->task?taskDetails->task->timeoutMS()*1000:0;
+
+    if(!taskDetails->task)
+      releaseTaskDetails(taskDetails);
+    else if(runAgain==RunAgain::Suspend)
+    {
+      // The worker that ran the task will look at the scheduler next so it does not need a wake.
+      taskDetails->active = false;
+      taskDetails->suspended = true;
+      if(taskDetails->resumeAtUS>=0)
+      {
+        taskDetails->nextRunUS = taskDetails->resumeAtUS;
+        taskDetails->resumeAtUS = -1;
+        scheduleTask(taskDetails, currentTimeUS_lt());
+      }
+      else
+        suspendedTasks.insert(taskDetails);
+    }
+    else if(periodUS<1 || runAgain==RunAgain::No)
+    {
+      tasks.erase(taskDetails->task->taskID());
+      removeTaskStatus(taskDetails);
+
+      lock.unlock(TPM);
+      TaskStatus taskStatus = taskDetails->task->taskStatus();
+      taskStatus.complete = true;
+      taskDetails->task->updateTaskStatus(taskStatus);
+      delete taskDetails->task;
+      taskDetails->task = nullptr;
+      lock.lock(TPM);
+      releaseTaskDetails(taskDetails);
+    }
+    else
+    {
+      int64_t now = currentTimeUS_lt();
+      taskDetails->nextRunUS = nextRunUS(taskDetails, periodUS, now);
+      taskDetails->waitingMessage = -1;
+      taskDetails->active = false;
+      if(statisticsEnabled.load(std::memory_order_relaxed))
+        statisticsForThisThread()->reschedules.fetch_add(1, std::memory_order_relaxed);
+      scheduleTask(taskDetails, now);
+    }
+  }
+
+  //################################################################################################
+  //! Schedule a suspended task at time, or remember the resume if it is still running.
+  /*!
+  Call with mutex locked.
+  \return True if a worker should be woken for the task.
+  */
+  bool resumeTask(TaskDetails_lt* taskDetails, int64_t time)
+  {
+    if(suspendedTasks.erase(taskDetails))
+    {
+      taskDetails->nextRunUS = time;
+      return scheduleTask(taskDetails, currentTimeUS_lt());
+    }
+
+    if(taskDetails->active)
+      taskDetails->resumeAtUS = time;
+    return false;
+  }
+
+  //################################################################################################
+  //! When a periodic task that has just run should run again, see TimerMode.
+  /*!
+  \param period The timeout of the task in us, as read by finishTask.
+  */
+  int64_t nextRunUS(const TaskDetails_lt* taskDetails, int64_t period, int64_t now) const
+  {
+    if(period<=0)
+      return now;
+
+    int64_t deadline = taskDetails->nextRunUS;
+    switch(taskDetails->task->timerMode())
+    {
+    case TimerMode::FixedDelay:
+      break;
+
+    case TimerMode::FixedRate:
+      return deadline + period;
+
+    case TimerMode::FixedRateSkip:
+      if(deadline+period > now)
+        return deadline + period;
+      return deadline + ((now-deadline)/period + 1)*period;
+    }
+    return now + period;
+  }
+
+  //################################################################################################
+  //! Wake a parked worker for new work unless enough workers are spinning, call with mutex locked.
+  void wakeWorker()
+  {
+    adaptThreads(tp_utils::currentTimeMS());
+
+    size_t spinning = spinningThreads.load();
+    if(spinning==0 || spinning<readyTasks.size())
+      waitCondition.wakeOne();
+  }
+
+  //################################################################################################
+  //! Wake up to count parked workers, call with mutex locked.
+  void wakeWorkers(size_t count)
+  {
+    if(count>=numberOfActiveTaskThreads)
+      waitCondition.wakeAll();
+    else
+      for(size_t i=0; i<count; i++)
+        waitCondition.wakeOne();
+  }
+
+  //################################################################################################
+  //! Wake just enough parked workers to bring the pool down to numberOfTaskThreads.
+  /*!
+  Call with mutex locked. Busy workers notice when they finish their task and each worker checks
+  the count under the mutex before it exits, so no more than the excess leave.
+  */
+  void wakeExcessWorkers()
+  {
+    if(numberOfActiveTaskThreads>numberOfTaskThreads)
+      wakeWorkers(tpMin(idleThreads, numberOfActiveTaskThreads-numberOfTaskThreads));
+  }
+
+  //################################################################################################
+  //! Grow an adaptive pool if tasks have been waiting with no idle worker, call with mutex locked.
+  /*!
+  This is checked as tasks are added, taken and finished. Once a backlog starts the admin thread
+  checks it again adaptiveGrowDelayMS_lt later, so a pool whose workers are all blocked also grows.
+  While the admin thread is disabled nothing would check it later so a thread is added straight
+  away.
+  */
+  void adaptThreads(int64_t now)
+  {
+    if(maximumThreads==0 ||
+       numberOfTaskThreads>=maximumThreads ||
+       finish ||
+       readyTasks.empty() ||
+       idleThreads>0 ||
+       spinningThreads.load()>0)
+    {
+      backlogSince = 0;
+      return;
+    }
+
+    if(!adminThreadRunning)
+      backlogSince = 0;
+    else if(backlogSince==0)
+    {
+      backlogSince = now;
+      updateWaitingMessagesWaitCondition.wakeAll();
+      return;
+    }
+    else if(now-backlogSince < adaptiveGrowDelayMS_lt)
+      return;
+    else
+      backlogSince = now;
+
+    numberOfTaskThreads++;
+    addThreads();
+  }
+
+  //################################################################################################
+  //! Spin with backoff while there is no work, call with mutex locked.
+  /*!
+  The mutex is released while spinning, the caller should look for work again before parking as
+  wakes are not delivered to spinning workers.
+  */
+  void spinForWork(TPMutexLocker& lock, bool checkDeques)
+  {
+    int64_t spinUS = idleSpinUS.load(std::memory_order_relaxed);
+    if(spinUS<=0)
+      return;
+
+    spinningThreads++;
+    lock.unlock(TPM);
+
+    auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(spinUS);
+    for(size_t backoff=1; !finish; backoff=tpMin(backoff*2, maxSpinBackoff_lt))
+    {
+      if(readyTasksHint.load(std::memory_order_relaxed)>0 ||
+         nextTimerHint.load(std::memory_order_relaxed)<=currentTimeUS_lt() ||
+         (checkDeques && workerDequesHaveTasks()))
+        break;
+
+      for(size_t i=0; i<backoff; i++)
+        cpuRelax_lt();
+
+      if(backoff==maxSpinBackoff_lt)
+        std::this_thread::yield();
+
+      if(std::chrono::steady_clock::now()>=end)
+        break;
+    }
+
+    spinningThreads--;
+    lock.lock(TPM);
+  }
+
+  //################################################################################################
+  //! Park the worker until it is woken or the next timer is due, call with mutex locked.
+  /*!
+  \param idleSince When this worker last ran a task.
+  \return True if the worker should exit because an adaptive pool has had it idle for too long.
+  */
+  bool parkWorker(TPMutexLocker& lock, int64_t waitFor, int64_t idleSince)
+  {
+    bool canShrink = maximumThreads>0 && numberOfTaskThreads>minimumThreads;
+    if(canShrink)
+    {
+      int64_t untilIdleTimeout = idleSince + adaptiveIdleTimeoutMS_lt - tp_utils::currentTimeMS();
+      waitFor = tpMin(waitFor, tpMax(int64_t(1), untilIdleTimeout));
+    }
+
+    TraceRing_lt* ring = traceRing();
+    int64_t parkedNS = ring?currentTimeNS_lt():0;
+
+    idleThreads++;
+    if(shuttingDown)
+      threadFinishedWaitCondition.wakeAll();
+    waitCondition.wait(TPMc lock, waitFor);
+    idleThreads--;
+
+    if(ring)
+      ring->record(TraceEventType_lt::Parked, nullptr, 0, parkedNS, currentTimeNS_lt());
+
+    if(statisticsEnabled.load(std::memory_order_relaxed))
+      statisticsForThisThread()->wakeups.fetch_add(1, std::memory_order_relaxed);
+
+    if(!canShrink || finish || !readyTasks.empty())
+      return false;
+
+    if(maximumThreads==0 || numberOfTaskThreads<=minimumThreads)
+      return false;
+
+    if(tp_utils::currentTimeMS()-idleSince < adaptiveIdleTimeoutMS_lt)
+      return false;
+
+    numberOfTaskThreads--;
+    return true;
+  }
+
+  //################################################################################################
+  //! Worker loop for SchedulingMode::Shared, call with mutex locked.
+  void runSharedWorker(TPMutexLocker& lock)
+  {
+    bool spun=false;
+    int64_t idleSince = tp_utils::currentTimeMS();
+    while(!finish)
+    {
+      if(numberOfActiveTaskThreads>numberOfTaskThreads)
+        break;
+
+      updatePlacement();
+
+      int64_t waitFor = INT64_MAX;
+      TaskDetails_lt* taskDetails = takeNextTask(waitFor);
+      if(!taskDetails)
+      {
+        if(!spun)
+        {
+          spinForWork(lock, false);
+          spun = true;
+        }
+        else
+        {
+          spun = false;
+          if(parkWorker(lock, waitFor, idleSince))
+            break;
+        }
+        continue;
+      }
+
+      spun = false;
+      taskDetails->active = true;
+
+      // Tasks that were added while this was spinning are only seen as a backlog from here.
+      adaptThreads(tp_utils::currentTimeMS());
+
+      lock.unlock(TPM);
+      auto runAgain = runTask(taskDetails);
+      lock.lock(TPM);
+
+      finishTask(lock, taskDetails, runAgain);
+      idleSince = tp_utils::currentTimeMS();
+      adaptThreads(idleSince);
+    }
+  }
+
+  //################################################################################################
+  //! Worker loop for SchedulingMode::WorkStealing, call with mutex locked.
+  /*!
+  Tasks are popped and stolen without the mutex, it is only taken to complete a task or to park the
+  worker once there is no work left anywhere.
+  */
+  void runWorkStealingWorker(TPMutexLocker& lock)
+  {
+    Worker_lt* worker = claimWorker();
+    currentWorker_lt = worker;
+
+    size_t iteration=0;
+    bool spun=false;
+    int64_t idleSince = tp_utils::currentTimeMS();
+    while(!finish)
+    {
+      if(numberOfActiveTaskThreads>numberOfTaskThreads)
+        break;
+
+      updatePlacement();
+
+      lock.unlock(TPM);
+      TaskDetails_lt* taskDetails = findWorkStealingTask(worker, (++iteration%32)==0);
+      bool run = taskDetails && !taskDetails->paused();
+      auto runAgain = RunAgain::No;
+      if(run)
+      {
+        taskDetails->active = true;
+        runAgain = runTask(taskDetails);
+      }
+      lock.lock(TPM);
+
+      if(run)
+      {
+        finishTask(lock, taskDetails, runAgain);
+        spun = false;
+        idleSince = tp_utils::currentTimeMS();
+        adaptThreads(idleSince);
+        continue;
+      }
+
+      if(taskDetails)
+      {
+        parkPausedTask(taskDetails);
+        continue;
+      }
+
+      int64_t waitFor = INT64_MAX;
+      taskDetails = takeNextTask(waitFor);
+      if(taskDetails)
+      {
+        taskDetails->active = true;
+        adaptThreads(tp_utils::currentTimeMS());
+        lock.unlock(TPM);
+        runAgain = runTask(taskDetails);
+        lock.lock(TPM);
+        finishTask(lock, taskDetails, runAgain);
+        spun = false;
+        idleSince = tp_utils::currentTimeMS();
+        adaptThreads(idleSince);
+        continue;
+      }
+
+      // The mutex was released while looking for work so check again before parking. Tasks are only
+      // pushed onto deques with the mutex locked so this can't miss a wake.
+      if(finish || numberOfActiveTaskThreads>numberOfTaskThreads || workerDequesHaveTasks())
+        continue;
+
+      if(!spun)
+      {
+        spinForWork(lock, true);
+        spun = true;
+        continue;
+      }
+
+      spun = false;
+      if(parkWorker(lock, waitFor, idleSince))
+        break;
+    }
+
+    // Hand any remaining tasks back to the shared queue before the slot is released.
+    int64_t now = currentTimeUS_lt();
+    size_t handedBack=0;
+    while(TaskDetails_lt* taskDetails = worker->deque.pop())
+    {
+      readyTasks.push(taskDetails, now);
+      handedBack++;
+    }
+    updateSchedulerHints();
+    wakeWorkers(handedBack);
+
+    currentWorker_lt = nullptr;
+    worker->inUse = false;
+  }
+
+  //################################################################################################
+  //! Apply the CPU placement to the calling worker if it has changed, call with mutex locked.
+  void updatePlacement()
+  {
+    uint64_t generation = placementGeneration.load(std::memory_order_relaxed);
+    if(currentPlacement_lt.generation == generation)
+      return;
+
+    currentPlacement_lt.generation = generation;
+    currentPlacement_lt.numaNode = -1;
+
+    std::vector<int> cpus = threadCPUs;
+    if(numaPlacement)
+    {
+      // Node IDs can have gaps for offline nodes, workers only go to nodes they can run on.
+      std::vector<size_t> nodes;
+      std::vector<std::vector<int>> nodesCPUs;
+      for(size_t node=0; node<numaNodeCPUs.size(); node++)
+      {
+        std::vector<int> nodeCPUs = numaNodeCPUs[node];
+        if(!threadCPUs.empty())
+          nodeCPUs.erase(std::remove_if(nodeCPUs.begin(), nodeCPUs.end(), [&](int cpu)
+          {
+            return std::find(threadCPUs.begin(), threadCPUs.end(), cpu)==threadCPUs.end();
+          }), nodeCPUs.end());
+
+        if(!nodeCPUs.empty())
+        {
+          nodes.push_back(node);
+          nodesCPUs.push_back(std::move(nodeCPUs));
+        }
+      }
+
+      if(nodes.size()>1)
+      {
+        size_t i = currentPlacement_lt.slot % nodes.size();
+        currentPlacement_lt.numaNode = int(nodes.at(i));
+        cpus = std::move(nodesCPUs.at(i));
+      }
+    }
+
+    setCurrentThreadCPUs_lt(cpus);
+  }
+
+  //################################################################################################
+  //! Call with mutex locked after changing the placement settings.
+  /*!
+  Parked workers are left alone, each worker applies the placement before it next looks for work.
+  */
+  void placementChanged()
+  {
+    placementGeneration++;
+  }
+
+  //################################################################################################
+  //! True once nothing is ready, running or suspended, call with mutex locked.
+  /*!
+  Periodic tasks waiting for their next run and paused tasks don't count, see TaskQueue::shutdown.
+  */
+  bool drained()
+  {
+    if(!readyTasks.empty() ||
+       !suspendedTasks.empty() ||
+       helperTasksRunning>0 ||
+       workerDequesHaveTasks())
+      return false;
+
+    // Workers that are neither parked nor spinning may be running a task.
+    if(numberOfActiveTaskThreads > idleThreads + spinningThreads.load())
+      return false;
+
+    for(TaskDetails_lt* taskDetails : timerTasks)
+      if(taskDetails->suspended)
+        return false;
+
+    for(const auto& i : concurrencyGroups)
+      if(!i.second->waiting.empty())
+        return false;
+
+    return true;
+  }
+
+  //################################################################################################
+  //! Ask the tasks that are running to finish, call with mutex locked.
+  void cancelRunningTasks()
+  {
+    for(const auto& i : tasks)
+      if(i.second->active)
+        i.second->task->cancelTask();
+  }
+
+  //################################################################################################
+  //! Wait until done returns true or the deadline passes, call with mutex locked.
+  /*!
+  \param deadline In ms from tp_utils::currentTimeMS.
+  \return True if done returned true.
+  */
+  template<typename F>
+  bool waitForShutdown(TPMutexLocker& lock, int64_t deadline, const F& done)
+  {
+    while(!done())
+    {
+      int64_t now = tp_utils::currentTimeMS();
+      if(now>=deadline)
+        return false;
+      threadFinishedWaitCondition.wait(TPMc lock, deadline-now);
+    }
+    return true;
+  }
+
+  //################################################################################################
+  void addThreads()
+  {
+    if(finish)
+      return;
+
+    while(numberOfActiveTaskThreads<numberOfTaskThreads)
+    {
+      numberOfActiveTaskThreads++;
+      size_t slot = nextThreadSlot++;
+      workerThreads.emplace(slot, std::thread([&, slot]()
+      {
+        lib_platform::setThreadName(threadName);
+        currentTaskQueue_lt = this;
+        currentPlacement_lt.slot = slot;
+        std::thread previous;
+        {
+          TPMutexLocker lock(mutex);
+          currentThreadStatistics_lt = claimThreadStatistics();
+          TraceRing_lt* ring = claimTraceRing(true);
+          updatePlacement();
+          if(schedulingMode == SchedulingMode::WorkStealing)
+            runWorkStealingWorker(lock);
+          else
+            runSharedWorker(lock);
+          currentThreadStatistics_lt->inUse = false;
+          currentThreadStatistics_lt = nullptr;
+          ring->inUse = false;
+          currentTraceRing_lt = CurrentTraceRing_lt();
+
+          auto i = workerThreads.find(slot);
+          previous = std::move(exitedWorkerThread);
+          exitedWorkerThread = std::move(i->second);
+          workerThreads.erase(i);
+
+          numberOfActiveTaskThreads--;
+          threadFinishedWaitCondition.wakeAll();
+        }
+
+        // Nothing of the queue is touched from here so it can be deleted once this is joined.
+        if(previous.joinable())
+          previous.join();
+      }));
+    }
+  }
+};
+
+//##################################################################################################
+TaskQueue::TaskQueue(const std::string& threadName, size_t nThreads, SchedulingMode schedulingMode):
+  d(new Private(threadName, nThreads, schedulingMode))
+{  
+  TPMutexLocker lock(d->mutex);
+  d->addThreads();
+
+  d->startAdminThread(lock);
+}
+
+//##################################################################################################
+TaskQueue::~TaskQueue()
+{
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    if(d->onQueueThread())
+    {
+      tpWarning() << "TaskQueue deleted from one of its own threads, it would wait for itself.";
+      std::abort();
+    }
+  }
+
+  // Tasks that never ran are cancelled so that a TaskGraph waiting on them skips the rest.
+  for(Task* task : shutdown(ShutdownMode::Cancel))
+  {
+    task->cancelTask();
+    delete task;
+  }
+
+  delete d;
+}
+
+//##################################################################################################
+std::vector<Task*> TaskQueue::shutdown(ShutdownMode mode, int64_t timeoutMS)
+{
+  std::vector<Task*> unexecuted;
+  std::vector<TaskDetails_lt*> remaining;
+  std::thread exitedWorkerThread;
+  {
+    TPMutexLocker lock(d->mutex);
+    if(d->onQueueThread())
+    {
+      tpWarning() << "TaskQueue::shutdown called from one of the queue's own threads, ignored.";
+      return unexecuted;
+    }
+
+    if(d->shuttingDown)
+      return unexecuted;
+    d->shuttingDown = true;
+
+    int64_t deadline = (timeoutMS<0)?INT64_MAX:(tp_utils::currentTimeMS() + timeoutMS);
+
+    // Without workers nothing would run the queued tasks, so they are handed back as by Cancel.
+    auto drained = [&]{return d->drained() || (d->numberOfTaskThreads==0 && d->maximumThreads==0);};
+
+    bool inTime = true;
+    if(mode == ShutdownMode::Drain)
+      inTime = d->waitForShutdown(lock, deadline, drained);
+    else if(mode == ShutdownMode::Cancel)
+      d->cancelRunningTasks();
+
+    d->finish = true;
+    d->waitCondition.wakeAll();
+
+    auto stopped = [&]{return d->numberOfActiveTaskThreads==0 && d->helperTasksRunning==0;};
+    if(!inTime || !d->waitForShutdown(lock, deadline, stopped))
+    {
+      d->cancelRunningTasks();
+      while(!stopped())
+        d->threadFinishedWaitCondition.wait(TPMc lock);
+    }
+
+    d->joinAdminThread(lock);
+    exitedWorkerThread = std::move(d->exitedWorkerThread);
+
+    // Posted closures that never ran are not in tasks. These are taken first as the tasks that are
+    // handed back lose their task pointer below.
+    d->readyTasks.forEach([&](TaskDetails_lt* taskDetails)
+    {
+      if(!taskDetails->task)
+        remaining.push_back(taskDetails);
+    });
+
+    for(const auto& i : d->tasks)
+    {
+      TaskDetails_lt* taskDetails = i.second;
+      d->removeTaskStatus(taskDetails);
+      if(taskDetails->suspended || taskDetails->task->shouldFinish())
+        taskDetails->task->cancelTask();
+      else
+      {
+        // Detach the task from this queue so that it can be added to another.
+        Task* task = taskDetails->task;
+        task->setTaskStatusChangedCallback(nullptr);
+        task->setTaskQueue(nullptr);
+        unexecuted.push_back(task);
+        taskDetails->task = nullptr;
+      }
+      remaining.push_back(taskDetails);
+    }
+    d->tasks.clear();
+
+    d->readyTasks = ReadyQueue_lt();
+    d->timerTasks.clear();
+    d->pausedTasks.clear();
+    d->suspendedTasks.clear();
+    for(const auto& i : d->concurrencyGroups)
+      i.second->waiting.clear();
+    d->updateSchedulerHints();
+  }
+
+  if(exitedWorkerThread.joinable())
+    exitedWorkerThread.join();
+
+  // Tasks and closures are destroyed without the lock as this may break the promise of a submit
+  // or resume a coroutine that was waiting on one of them, which would call back into the queue.
+  for(TaskDetails_lt* taskDetails : remaining)
+    delete taskDetails;
+
+  d->taskStatusChanged();
+  return unexecuted;
+}
+
+//##################################################################################################
+size_t TaskQueue::numberOfTaskThreads() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->numberOfTaskThreads;
+}
+
+//##################################################################################################
+void TaskQueue::setNumberOfTaskThreads(size_t numberOfTaskThreads)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->numberOfTaskThreads = numberOfTaskThreads;
+  d->addThreads();
+  d->wakeExcessWorkers();
+}
+
+//##################################################################################################
+void TaskQueue::setAdaptiveThreads(size_t minimumThreads, size_t maximumThreads)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  if(maximumThreads<minimumThreads)
+    maximumThreads = minimumThreads;
+
+  d->minimumThreads = minimumThreads;
+  d->maximumThreads = maximumThreads;
+  d->backlogSince = 0;
+
+  if(maximumThreads>0)
+  {
+    d->numberOfTaskThreads = tpMax(minimumThreads, tpMin(maximumThreads, d->numberOfTaskThreads));
+    d->addThreads();
+    d->wakeExcessWorkers();
+  }
+}
+
+//##################################################################################################
+size_t TaskQueue::minimumThreads() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->minimumThreads;
+}
+
+//##################################################################################################
+size_t TaskQueue::maximumThreads() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->maximumThreads;
+}
+
+//##################################################################################################
+int64_t TaskQueue::idleSpinUS() const
+{
+  return d->idleSpinUS;
+}
+
+//##################################################################################################
+void TaskQueue::setIdleSpinUS(int64_t idleSpinUS)
+{
+  d->idleSpinUS = idleSpinUS;
+}
+
+//##################################################################################################
+size_t TaskQueue::taskPoolSize() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->taskPoolSize;
+}
+
+//##################################################################################################
+void TaskQueue::setTaskPoolSize(size_t taskPoolSize)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->taskPoolSize = taskPoolSize;
+  while(d->freeTaskDetails.size()>taskPoolSize)
+  {
+    delete d->freeTaskDetails.back();
+    d->freeTaskDetails.pop_back();
+  }
+}
+
+//##################################################################################################
+std::vector<int> TaskQueue::threadCPUs() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->threadCPUs;
+}
+
+//##################################################################################################
+void TaskQueue::setThreadCPUs(const std::vector<int>& threadCPUs)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->threadCPUs = threadCPUs;
+  d->placementChanged();
+}
+
+//##################################################################################################
+bool TaskQueue::numaPlacement() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->numaPlacement;
+}
+
+//##################################################################################################
+void TaskQueue::setNUMAPlacement(bool numaPlacement)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->numaPlacement = numaPlacement;
+  if(numaPlacement && d->numaNodeCPUs.empty())
+    d->numaNodeCPUs = numaNodeCPUs_lt();
+  d->placementChanged();
+}
+
+//##################################################################################################
+int64_t TaskQueue::priorityAgingMS() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->priorityAgingMS;
+}
+
+//##################################################################################################
+void TaskQueue::setPriorityAgingMS(int64_t priorityAgingMS)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  d->priorityAgingMS = priorityAgingMS;
+}
+
+//##################################################################################################
+size_t TaskQueue::concurrencyLimit(const std::string& concurrencyGroup) const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  auto i = d->concurrencyGroups.find(concurrencyGroup);
+  return (i==d->concurrencyGroups.end())?0:i->second->maxActive;
+}
+
+//##################################################################################################
+void TaskQueue::setConcurrencyLimit(const std::string& concurrencyGroup, size_t maxActive)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  ConcurrencyGroup_lt* group = d->concurrencyGroup(concurrencyGroup);
+  group->maxActive = maxActive;
+  d->wakeWorkers(d->requeueWaitingTasks(group));
+}
+
+//##################################################################################################
+bool TaskQueue::adminThreadEnabled() const
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  return d->adminThread && !d->stopAdminThread;
+}
+
+//##################################################################################################
+void TaskQueue::setAdminThreadEnabled(bool adminThreadEnabled)
+{
+  TPMutexLocker lock(d->mutex);
+  if(adminThreadEnabled)
+    d->startAdminThread(lock);
+  else
+    d->joinAdminThread(lock);
+}
+
+//##################################################################################################
+bool TaskQueue::statisticsEnabled() const
+{
+  return d->statisticsEnabled;
+}
+
+//##################################################################################################
+void TaskQueue::setStatisticsEnabled(bool statisticsEnabled)
+{
+  if(statisticsEnabled && !d->statisticsEnabled)
+    resetStatistics();
+  d->statisticsEnabled = statisticsEnabled;
+}
+
+//##################################################################################################
+TaskQueueStatistics TaskQueue::statistics() const
+{
+  TaskQueueStatistics statistics;
+  std::array<uint64_t, Histogram_lt::numberOfBuckets> queueWait{};
+  std::array<uint64_t, Histogram_lt::numberOfBuckets> runTime{};
+  int64_t workerBusyNS=0;
+  size_t threads=0;
+
+  auto add = [&](const ThreadStatistics_lt* s)
+  {
+    statistics.tasksRun    += size_t(s->tasksRun.load(std::memory_order_relaxed));
+    statistics.reschedules += size_t(s->reschedules.load(std::memory_order_relaxed));
+    statistics.wakeups     += size_t(s->wakeups.load(std::memory_order_relaxed));
+    s->queueWait.addTo(queueWait);
+    s->runTime.addTo(runTime);
+  };
+
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    for(const ThreadStatistics_lt* s=d->threadStatistics; s; s=s->next)
+    {
+      add(s);
+      workerBusyNS += s->busyNS.load(std::memory_order_relaxed);
+    }
+    add(&d->helperStatistics);
+    threads = d->numberOfTaskThreads;
+  }
+
+  int64_t sinceNS = d->statisticsSinceNS.load(std::memory_order_relaxed);
+  int64_t elapsedNS = tpMax(int64_t(1), currentTimeNS_lt() - sinceNS);
+  statistics.elapsedMS = elapsedNS/1000000;
+  statistics.tasksPerSecond = double(statistics.tasksRun)*1e9/double(elapsedNS);
+  if(threads>0)
+  {
+    double capacityNS = double(elapsedNS)*double(threads);
+    statistics.workerUtilization = tpMin(1.0, double(workerBusyNS)/capacityNS);
+  }
+  statistics.queueWaitP50US = Histogram_lt::percentileUS(queueWait, 0.50);
+  statistics.queueWaitP99US = Histogram_lt::percentileUS(queueWait, 0.99);
+  statistics.runTimeP50US   = Histogram_lt::percentileUS(runTime, 0.50);
+  statistics.runTimeP99US   = Histogram_lt::percentileUS(runTime, 0.99);
+  return statistics;
+}
+
+//##################################################################################################
+void TaskQueue::resetStatistics()
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  for(ThreadStatistics_lt* s=d->threadStatistics; s; s=s->next)
+    s->reset();
+  d->helperStatistics.reset();
+  d->statisticsSinceNS = currentTimeNS_lt();
+}
+
+//##################################################################################################
+bool TaskQueue::tracingEnabled() const
+{
+  return d->tracingEnabled;
+}
+
+//##################################################################################################
+void TaskQueue::setTracingEnabled(bool tracingEnabled)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  if(tracingEnabled && !d->tracingEnabled)
+    for(const auto& ring : d->traceRings)
+      ring->first = ring->next.load();
+  d->tracingEnabled = tracingEnabled;
+}
+
+//##################################################################################################
+std::string TaskQueue::traceJSON() const
+{
+  std::vector<TraceRing_lt*> rings;
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    for(const auto& ring : d->traceRings)
+      rings.push_back(ring.get());
+  }
+
+  std::ostringstream out;
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool firstEvent=true;
+  auto separator = [&]
+  {
+    if(!firstEvent)
+      out << ",\n";
+    firstEvent = false;
+  };
+
+  separator();
+  out << "{\"ph\":\"M\",\"pid\":1,\"tid\":0,\"name\":\"process_name\",\"args\":{\"name\":";
+  appendJSONString_lt(out, d->threadName);
+  out << "}}";
+
+  // Timestamps are in microseconds from the steady clock.
+  auto us = [](int64_t ns)
+  {
+    return std::to_string(ns/1000) + "." + std::to_string(1000 + (ns%1000)).substr(1);
+  };
+
+  for(const TraceRing_lt* ring : rings)
+  {
+    separator();
+    out << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->tid;
+    out << ",\"name\":\"thread_name\",\"args\":{\"name\":";
+    appendJSONString_lt(out, ring->threadName + " " + std::to_string(ring->tid));
+    out << "}}";
+
+    ring->read([&](TraceEventType_lt type,
+                   const std::string& name,
+                   int64_t taskID,
+                   int64_t startNS,
+                   int64_t durationNS)
+    {
+      separator();
+      out << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid;
+      out << ",\"ts\":" << us(startNS) << ",\"dur\":" << us(durationNS) << ",\"name\":";
+      switch(type)
+      {
+      case TraceEventType_lt::Task:
+        appendJSONString_lt(out, name);
+        out << ",\"cat\":\"task\",\"args\":{\"taskID\":" << taskID << "}";
+        break;
+      case TraceEventType_lt::Closure:
+        out << "\"post\",\"cat\":\"task\"";
+        break;
+      case TraceEventType_lt::Parked:
+        out << "\"parked\",\"cat\":\"idle\"";
+        break;
+      }
+      out << "}";
+    });
+  }
+
+  out << "]}\n";
+  return out.str();
+}
+
+//##################################################################################################
+void TaskQueue::addTask(Task* task)
+{
+  task->setTaskQueue(this);
+
+  TPMutexLocker lock(d->mutex);
+  if(d->finish)
+  {
+    lock.unlock(TPM);
+    tpWarning() << "TaskQueue::addTask called after shutdown, the task will not be run.";
+    task->cancelTask();
+    delete task;
+    return;
+  }
+
+  int64_t now = currentTimeUS_lt();
+  TaskDetails_lt* taskDetails = d->createTaskDetails(task, now);
+
+  d->taskStatusMutex.lock(TPM);
+  d->addTaskStatus(taskDetails);
+  d->taskStatusMutex.unlock(TPM);
+
+  d->installStatusChangedCallback(taskDetails);
+  d->queueTask(taskDetails, now);
+  d->wakeWorker();
+  d->taskStatusChanged();
+}
+
+//##################################################################################################
+void TaskQueue::addTasks(const std::vector<Task*>& tasks)
+{
+  if(tasks.empty())
+    return;
+
+  for(Task* task : tasks)
+    task->setTaskQueue(this);
+
+  TPMutexLocker lock(d->mutex);
+  if(d->finish)
+  {
+    lock.unlock(TPM);
+    tpWarning() << "TaskQueue::addTasks called after shutdown, the tasks will not be run.";
+    for(Task* task : tasks)
+    {
+      task->cancelTask();
+      delete task;
+    }
+    return;
+  }
+
+  int64_t now = currentTimeUS_lt();
+
+  std::vector<TaskDetails_lt*> added;
+  added.reserve(tasks.size());
+  for(Task* task : tasks)
+    added.push_back(d->createTaskDetails(task, now));
+
+  d->taskStatusMutex.lock(TPM);
+  d->taskStatuses.reserve(d->taskStatuses.size() + added.size());
+  d->taskStatusDetails.reserve(d->taskStatusDetails.size() + added.size());
+  for(TaskDetails_lt* taskDetails : added)
+    d->addTaskStatus(taskDetails);
+  d->taskStatusMutex.unlock(TPM);
+
+  size_t ready=0;
+  for(TaskDetails_lt* taskDetails : added)
+  {
+    d->installStatusChangedCallback(taskDetails);
+    d->queueTask(taskDetails, now);
+    if(taskDetails->nextRunUS<=now)
+      ready++;
+  }
+
+  // One wake per runnable task plus one so that a worker picks up any new timers.
+  d->adaptThreads(tp_utils::currentTimeMS());
+  d->wakeWorkers(ready + ((ready<added.size())?1:0));
+
+  d->taskStatusChanged();
+}
+
+//##################################################################################################
+void TaskQueue::post(InplaceFunction<void()> closure)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  if(d->finish)
+  {
+    // The closure is destroyed once the mutex has been released.
+    tpWarning() << "TaskQueue::post called after shutdown, the closure will not be run.";
+    return;
+  }
+
+  auto taskDetails = d->acquireTaskDetails();
+  taskDetails->closure = std::move(closure);
+  if(!d->pushLocalTask(taskDetails, 0))
+  {
+    d->markReady(taskDetails, 0);
+    d->readyTasks.push(taskDetails, currentTimeUS_lt());
+    d->updateSchedulerHints();
+  }
+  d->wakeWorker();
+}
+
+//##################################################################################################
+bool TaskQueue::runPendingTask(const SynchronizationPoint* preferred)
+{
+  TPMutexLocker lock(d->mutex);
+  if(d->finish)
+    return false;
+
+  TaskDetails_lt* taskDetails = d->takePendingTask(preferred);
+  if(!taskDetails)
+    return false;
+
+  // A worker of another queue that is helping here keeps its own ring for when it returns.
+  CurrentTraceRing_lt previousTraceRing = currentTraceRing_lt;
+  if(d->tracingEnabled && !isWorkerThread())
+    d->claimTraceRing(false);
+
+  taskDetails->active = true;
+  d->helperTasksRunning++;
+  const void* previousHelped = helpedTaskQueue_lt;
+  helpedTaskQueue_lt = d;
+  lock.unlock(TPM);
+  auto runAgain = d->runTask(taskDetails);
+  lock.lock(TPM);
+  helpedTaskQueue_lt = previousHelped;
+  d->finishTask(lock, taskDetails, runAgain);
+  d->helperTasksRunning--;
+  if(d->shuttingDown)
+    d->threadFinishedWaitCondition.wakeAll();
+  currentTraceRing_lt = previousTraceRing;
+  return true;
+}
+
+//##################################################################################################
+void TaskQueue::waitForPendingTask(const std::function<bool()>& done)
+{
+  TPMutexLocker lock(d->mutex);
+
+  // Once the queue has stopped nothing will be run so only wakeHelpers ends the wait.
+  int64_t waitFor = INT64_MAX;
+  if(!d->finish)
+  {
+    if(!d->readyTasks.empty() || d->workerDequesHaveTasks())
+      return;
+
+    if(!d->timerTasks.empty())
+    {
+      waitFor = waitForMS_lt(d->timerTasks.front()->nextRunUS - currentTimeUS_lt());
+      if(waitFor==0)
+        return;
+    }
+  }
+
+  if(done())
+    return;
+
+  d->helpersWaiting++;
+  d->waitCondition.wait(TPMc lock, waitFor);
+  d->helpersWaiting--;
+}
+
+//##################################################################################################
+void TaskQueue::wakeHelpers()
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  if(d->helpersWaiting>0)
+    d->waitCondition.wakeAll();
+}
+
+//##################################################################################################
+void TaskQueue::resumeTask(int64_t taskID, int64_t delayMS)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  auto i = d->tasks.find(taskID);
+  int64_t resumeAtUS = currentTimeUS_lt() + tpMax(int64_t(0), delayMS)*1000;
+  if(i != d->tasks.end() && d->resumeTask(i->second, resumeAtUS))
+    d->wakeWorker();
+}
+
+//##################################################################################################
+bool TaskQueue::isWorkerThread() const
+{
+  return currentTaskQueue_lt == d;
+}
+
+//##################################################################################################
+void TaskQueue::cancelTask(int64_t taskID)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  auto i = d->tasks.find(taskID);
+  if(i != d->tasks.end())
+  {
+    // This only sets a flag that the task checks, unless it is suspended it becomes runnable no
+    // sooner.
+    i->second->task->cancelTask();
+    if(d->suspendedTasks.count(i->second) && d->resumeTask(i->second, currentTimeUS_lt()))
+      d->wakeWorker();
+  }
+}
+
+//##################################################################################################
+void TaskQueue::pauseTask(int64_t taskID, bool paused)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  auto i = d->tasks.find(taskID);
+  if(i != d->tasks.end())
+    d->setTaskPaused(i->second, paused);
+}
+
+//##################################################################################################
+void TaskQueue::togglePauseTask(int64_t taskID)
+{
+  TP_MUTEX_LOCKER(d->mutex);
+  auto i = d->tasks.find(taskID);
+  if(i != d->tasks.end())
+  {
+    TaskDetails_lt* taskDetails = i->second;
+    d->setTaskPaused(taskDetails, !taskDetails->task->paused());
+  }
+}
+
+//##################################################################################################
+void TaskQueue::viewTaskStatus(const std::function<void(const std::vector<TaskStatus>&)>& closure)
+{
+  closure(*taskStatusSnapshot());
+}
+
+//##################################################################################################
+std::shared_ptr<const std::vector<TaskStatus>> TaskQueue::taskStatusSnapshot()
+{
+  TP_MUTEX_LOCKER(d->taskStatusMutex);
+  if(!d->taskStatusSnapshot || d->taskStatusSnapshotRevision!=d->statusRevision)
+  {
+    d->compactTaskStatuses();
+    d->taskStatusSnapshot = std::make_shared<const std::vector<TaskStatus>>(d->taskStatuses);
+    d->taskStatusSnapshotRevision = d->statusRevision;
+  }
+  return d->taskStatusSnapshot;
+}
+
+//##################################################################################################
+TaskStatusChanges TaskQueue::taskStatusChangesSince(int64_t rev)
 {
+  TaskStatusChanges changes;
+
   TP_MUTEX_LOCKER(d->taskStatusMutex);
-  closure(d->taskStatuses);
+  changes.rev = d->statusRevision;
+  if(rev>=d->statusRevision)
+    return changes;
+
+  changes.reset = (rev<d->removedTaskStatusesHorizon);
+  if(changes.reset)
+  {
+    d->compactTaskStatuses();
+    changes.statuses = d->taskStatuses;
+  }
+  else
+  {
+    // Walk back from the newest status until one is reached that the caller already has.
+    for(TaskDetails_lt* t=d->newestStatus; t; t=t->olderStatus)
+    {
+      const TaskStatus& ts = d->taskStatuses[t->statusIndex];
+      if(ts.rev<=rev)
+        break;
+      changes.statuses.push_back(ts);
+    }
+    std::reverse(changes.statuses.begin(), changes.statuses.end());
+
+    auto i = std::upper_bound(d->removedTaskStatuses.begin(),
+                              d->removedTaskStatuses.end(),
+                              rev,
+                              [](int64_t r, const auto& removed){return r<removed.first;});
+
+    for(; i!=d->removedTaskStatuses.end(); ++i)
+      changes.removedTaskIDs.push_back(i->second);
+  }
+
+  return changes;
+}
+
+//##################################################################################################
+int64_t TaskQueue::statusChangedInterval() const
+{
+  return d->statusChangedInterval;
+}
+
+//##################################################################################################
+void TaskQueue::setStatusChangedInterval(int64_t statusChangedInterval)
+{
+  {
+    TP_MUTEX_LOCKER(d->mutex);
+    d->statusChangedInterval = statusChangedInterval;
+    d->updateWaitingMessagesWaitCondition.wakeAll();
+  }
+
+  // Don't leave changes that were waiting for the admin thread undelivered.
+  if(statusChangedInterval<1 && d->statusChangedPending.exchange(false))
+    d->notifyStatusChanged();
 }
 
 //##################################################################################################
@@ -4,31 +4,119 @@
 #include "tp_task_queue/SynchronizationPoint.h"
 
 #include "tp_utils/MutexUtils.h"
+#include "tp_utils/TimeUtils.h"
 
 #include "lib_platform/SetThreadName.h"
 
-#include <queue>
+#include <atomic>
 #include <thread>
 
 namespace tp_task_queue
 {
 
+namespace
+{
+//##################################################################################################
+//! An intrusive multi-producer single-consumer queue.
+/*!
+Producers only do an atomic exchange on the head. pop must only be called by one consumer at a
+time, the consumer can change between calls as long as the hand over is synchronized. empty can be
+called from any thread but may report a task that has just been taken.
+*/
+struct MPSCQueue_lt
+{
+  TP_NONCOPYABLE(MPSCQueue_lt);
+
+  struct Node
+  {
+    std::atomic<Node*> next{nullptr};
+    InplaceFunction<void()> task;
+  };
+
+  Node stub;
+  std::atomic<Node*> head{&stub};
+
+  //! Only written by the consumer, atomic so that empty can be checked before taking ownership.
+  std::atomic<Node*> tail{&stub};
+
+  //################################################################################################
+  MPSCQueue_lt()=default;
+
+  //################################################################################################
+  ~MPSCQueue_lt()
+  {
+    InplaceFunction<void()> task;
+    while(pop(task)){}
+    if(Node* node = tail.load(); node != &stub)
+      delete node;
+  }
+
+  //################################################################################################
+  void push(InplaceFunction<void()> task)
+  {
+    auto node = new Node();
+    node->task = std::move(task);
+    Node* prev = head.exchange(node);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  //################################################################################################
+  //! Take the next task, returns false if the queue is empty.
+  bool pop(InplaceFunction<void()>& task)
+  {
+    Node* node = tail.load(std::memory_order_relaxed);
+    Node* next = node->next.load(std::memory_order_acquire);
+    while(!next)
+    {
+      if(head.load() == node)
+        return false;
+
+      // A producer has swapped the head but not linked it in yet.
+      std::this_thread::yield();
+      next = node->next.load(std::memory_order_acquire);
+    }
+
+    // The popped node becomes the new stub.
+    tail.store(next, std::memory_order_relaxed);
+    task = std::move(next->task);
+    next->task = nullptr;
+    if(node != &stub)
+      delete node;
+    return true;
+  }
+
+  //################################################################################################
+  bool empty() const
+  {
+    return head.load() == tail.load(std::memory_order_relaxed);
+  }
+};
+}
+
 //##################################################################################################
 struct WorkQueue::Private
 {
   std::string taskName;
   TaskQueue* taskQueue{nullptr};
 
+  MPSCQueue_lt queue;
+
+  //! The consumer thread sets this before it parks, producers only lock to wake it if it is set.
+  std::atomic_bool sleeping{false};
+  std::atomic_bool finish{false};
   TPMutex mutex{TPM};
   TPWaitCondition waitCondition;
-  std::queue<std::function<void()>> queue;
-  bool finish{false};
 
   std::unique_ptr<std::thread> thread;
 
-  int activeTask{false};
+  //! Set while a task is on the TaskQueue to drain the queue, only that task pops.
+  std::atomic_bool activeTask{false};
   SynchronizationPoint synchronizationPoint;
 
+  //! Limits on how much work a single task on the TaskQueue does, see WorkQueue::setBatchSize.
+  std::atomic<size_t> batchSize{1};
+  std::atomic<int64_t> batchTimeMS{0};
+
   //################################################################################################
   Private(const std::string& threadName):
     thread(new std::thread([=]{run(threadName);}))
@@ -65,45 +153,91 @@ struct WorkQueue::Private
   {
     lib_platform::setThreadName(threadName);
 
-    TPMutexLocker lock(mutex);
-    while(!finish || !queue.empty())
+    InplaceFunction<void()> task;
+    for(;;)
     {
-      if(queue.empty())
-        waitCondition.wait(TPMc lock);
-      else
+      if(queue.pop(task))
       {
-        auto task = queue.front();
-        queue.pop();
+        task();
+        task = nullptr;
+        continue;
+      }
 
-        {
-          TP_MUTEX_UNLOCKER(lock);
-          task();
-        }
+      if(finish)
+        break;
+
+      // Announce that we are going to sleep then check again, a producer either sees sleeping or
+      // its task is seen here.
+      sleeping = true;
+      if(!queue.empty() || finish)
+      {
+        sleeping = false;
+        continue;
       }
+
+      TPMutexLocker lock(mutex);
+      while(sleeping && !finish)
+        waitCondition.wait(TPMc lock);
+      sleeping = false;
     }
   }
 
   //################################################################################################
-  void addNextTask()
+  void wake()
   {
-    if(queue.empty())
-      return;
+    if(sleeping.load() && sleeping.exchange(false))
+    {
+      TP_MUTEX_LOCKER(mutex);
+      waitCondition.wakeOne();
+    }
+  }
 
-    activeTask = true;
+  //################################################################################################
+  //! Claim the queue and add a task to the TaskQueue to run the next item, if nobody else has.
+  /*!
+  The owner clears activeTask before calling this again, so an item pushed while it was still set
+  is seen either here or by the producer that pushed it.
+  */
+  void scheduleNextTask()
+  {
+    while(!queue.empty())
+    {
+      if(activeTask.exchange(true))
+        return;
 
-    auto task = queue.front();
-    queue.pop();
+      if(!queue.empty())
+      {
+        addNextTask();
+        return;
+      }
 
-    auto t = new Task(taskName, [=](Task&)
+      activeTask = false;
+    }
+  }
+
+  //################################################################################################
+  //! Call with activeTask set by this thread and the queue not empty.
+  void addNextTask()
+  {
+    auto t = new Task(taskName, [this](Task&)
     {
-      task();
+      size_t maxTasks = tpMax(size_t(1), batchSize.load(std::memory_order_relaxed));
+      int64_t timeMS = batchTimeMS.load(std::memory_order_relaxed);
+      int64_t endTime = (timeMS>0)?(tp_utils::currentTimeMS()+timeMS):INT64_MAX;
 
+      InplaceFunction<void()> task;
+      for(size_t i=0; i<maxTasks && queue.pop(task); i++)
       {
-        TP_MUTEX_LOCKER(mutex);
-        activeTask = false;
-        addNextTask();
+        task();
+        task = nullptr;
+
+        if(endTime!=INT64_MAX && tp_utils::currentTimeMS()>=endTime)
+          break;
       }
 
+      activeTask = false;
+      scheduleNextTask();
+
       return RunAgain::No;
     });
     synchronizationPoint.addTask(t);
@@ -133,14 +267,38 @@ WorkQueue::~WorkQueue()
 }
 
 //##################################################################################################
-void WorkQueue::addTask(const std::function<void()>& task)
+size_t WorkQueue::batchSize() const
+{
+  return d->batchSize;
+}
+
+//##################################################################################################
+void WorkQueue::setBatchSize(size_t batchSize)
+{
+  d->batchSize = batchSize;
+}
+
+//##################################################################################################
+int64_t WorkQueue::batchTimeMS() const
+{
+  return d->batchTimeMS;
+}
+
+//##################################################################################################
+void WorkQueue::setBatchTimeMS(int64_t batchTimeMS)
+{
+  d->batchTimeMS = batchTimeMS;
+}
+
+//##################################################################################################
+void WorkQueue::addTask(InplaceFunction<void()> task)
 {
-  TP_MUTEX_LOCKER(d->mutex);
-  d->queue.push(task);
-  d->waitCondition.wakeOne();
+  d->queue.push(std::move(task));
 
-  if(d->taskQueue && !d->activeTask)
-    d->addNextTask();
+  if(d->taskQueue)
+    d->scheduleNextTask();
+  else
+    d->wake();
 }
 
 }
@@ -0,0 +1,213 @@
+#include "tp_task_queue/TaskQueue.h"
+#include "tp_task_queue/TaskGraph.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+//##################################################################################################
+//! Regression tests for tp_task_queue.
+/*!
+Each test prints a line with its name and whether it passed, the exit code is non-zero if any
+failed.
+
+Options:
+  --filter NAME Only run tests whose name contains NAME.
+*/
+
+using namespace tp_task_queue;
+
+namespace
+{
+using Clock_lt = std::chrono::steady_clock;
+
+//##################################################################################################
+struct Options_lt
+{
+  std::string filter;
+};
+
+Options_lt options_lt;
+int failures_lt{0};
+
+//##################################################################################################
+//! Wait for up to timeoutMS after start for condition to become true.
+template<typename F>
+bool waitUntil_lt(const F& condition, Clock_lt::time_point start, int64_t timeoutMS)
+{
+  auto end = start + std::chrono::milliseconds(timeoutMS);
+  while(!condition())
+  {
+    if(Clock_lt::now()>=end)
+      return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+//##################################################################################################
+bool enabled_lt(const char* name)
+{
+  return options_lt.filter.empty() || std::strstr(name, options_lt.filter.c_str());
+}
+
+//##################################################################################################
+//! Print the result of a test and count it if it failed.
+void report_lt(const char* test, bool passed)
+{
+  std::printf("%s %s\n", passed?"PASS":"FAIL", test);
+  std::fflush(stdout);
+  if(!passed)
+    failures_lt++;
+}
+
+//##################################################################################################
+//! A long dependency chain run against a queue that has been shut down is deleted without
+//! recursing once per node.
+void taskGraphAfterShutdown_lt()
+{
+  if(!enabled_lt("task_graph_after_shutdown"))
+    return;
+
+  size_t length = 100000;
+  TaskQueue taskQueue("test", 1);
+  taskQueue.shutdown(ShutdownMode::Cancel);
+
+  std::atomic<size_t> runs{0};
+  std::atomic<size_t> deleted{0};
+  {
+    TaskGraph taskGraph(&taskQueue);
+    size_t previous=0;
+    for(size_t i=0; i<length; i++)
+    {
+      // The captures of a task are released when it is deleted.
+      std::shared_ptr<void> guard(nullptr, [&](void*){deleted++;});
+      auto task = new Task("chain", [&, guard](Task&){runs++; return RunAgain::No;});
+      previous = (i==0)?taskGraph.addNode(task):taskGraph.addNode(task, {previous});
+    }
+
+    taskGraph.run();
+    taskGraph.join();
+  }
+
+  report_lt("task_graph_after_shutdown", runs==0 && deleted==length);
+}
+
+//##################################################################################################
+//! Draining a queue without worker threads hands back its tasks rather than waiting forever.
+void drainWithoutWorkers_lt()
+{
+  if(!enabled_lt("drain_without_workers"))
+    return;
+
+  TaskQueue taskQueue("test", 0);
+  std::atomic<size_t> runs{0};
+  for(size_t i=0; i<10; i++)
+    taskQueue.addTask(new Task("queued", [&](Task&){runs++; return RunAgain::No;}));
+
+  std::vector<Task*> unexecuted = taskQueue.shutdown(ShutdownMode::Drain);
+  size_t returned = unexecuted.size();
+  for(Task* task : unexecuted)
+    delete task;
+
+  report_lt("drain_without_workers", runs==0 && returned==10);
+}
+
+//##################################################################################################
+//! An adaptive pool whose workers are all blocked adds threads for the tasks that are waiting.
+void adaptiveGrowthWhenBlocked_lt()
+{
+  if(!enabled_lt("adaptive_growth_when_blocked"))
+    return;
+
+  for(bool adminThreadEnabled : {true, false})
+  {
+    TaskQueue taskQueue("test", 1);
+    taskQueue.setAdminThreadEnabled(adminThreadEnabled);
+    taskQueue.setAdaptiveThreads(1, 4);
+
+    std::atomic<size_t> started{0};
+    std::atomic_bool release{false};
+    auto start = Clock_lt::now();
+    for(size_t i=0; i<4; i++)
+    {
+      taskQueue.addTask(new Task("blocked", [&](Task&)
+      {
+        started++;
+        while(!release)
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return RunAgain::No;
+      }));
+    }
+
+    bool grew = waitUntil_lt([&]{return taskQueue.numberOfTaskThreads()>1;}, start, 50);
+    bool allStarted = waitUntil_lt([&]{return started==4;}, start, 500);
+    release = true;
+
+    report_lt(adminThreadEnabled?"adaptive_growth_when_blocked":
+                                 "adaptive_growth_when_blocked_without_admin_thread",
+              grew && allStarted);
+  }
+}
+
+//##################################################################################################
+//! Statuses stay in the order that the tasks were added as other tasks finish.
+void taskStatusOrder_lt()
+{
+  if(!enabled_lt("task_status_order"))
+    return;
+
+  TaskQueue taskQueue("test", 1);
+  std::vector<int64_t> expected;
+  for(size_t i=0; i<20; i++)
+  {
+    auto task = new Task("order", [](Task&){return RunAgain::No;}, 0, std::string(), true);
+    if(i%2==0)
+    {
+      task->setPaused(true);
+      expected.push_back(task->taskID());
+    }
+    taskQueue.addTask(task);
+  }
+
+  auto start = Clock_lt::now();
+  bool finished = waitUntil_lt([&]{return taskQueue.taskStatusSnapshot()->size()==expected.size();},
+                               start,
+                               1000);
+
+  std::vector<int64_t> taskIDs;
+  for(const TaskStatus& taskStatus : *taskQueue.taskStatusSnapshot())
+    taskIDs.push_back(taskStatus.taskID);
+
+  for(Task* task : taskQueue.shutdown(ShutdownMode::Cancel))
+    delete task;
+
+  report_lt("task_status_order", finished && taskIDs==expected);
+}
+}
+
+//##################################################################################################
+int main(int argc, char* argv[])
+{
+  for(int i=1; i<argc; i++)
+  {
+    if(std::strcmp(argv[i], "--filter")==0 && (i+1)<argc)
+      options_lt.filter = argv[++i];
+    else
+    {
+      std::fprintf(stderr, "Usage: %s [--filter NAME]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  taskGraphAfterShutdown_lt();
+  drainWithoutWorkers_lt();
+  adaptiveGrowthWhenBlocked_lt();
+  taskStatusOrder_lt();
+  return (failures_lt==0)?0:1;
+}
@@ -0,0 +1,4 @@
+TARGET = tp_task_queue_test
+TEMPLATE = app
+
+SOURCES += src/main.cpp
@@ -17,3 +17,15 @@ HEADERS += inc/tp_task_queue/SynchronizationPoint.h
 
 SOURCES += src/WorkQueue.cpp
 HEADERS += inc/tp_task_queue/WorkQueue.h
+
+SOURCES += src/TaskGraph.cpp
+HEADERS += inc/tp_task_queue/TaskGraph.h
+
+SOURCES += src/Parallel.cpp
+HEADERS += inc/tp_task_queue/Parallel.h
+
+SOURCES += src/Coroutine.cpp
+HEADERS += inc/tp_task_queue/Coroutine.h
+
+HEADERS += inc/tp_task_queue/InplaceFunction.h
+HEADERS += inc/tp_task_queue/Future.h